@@ -0,0 +1,9 @@
+#!/bin/sh
+# Build and run the micro-benchmarks against the sources in src/.
+# Usage: bench/run.sh (from the project root)
+set -e
+
+BUILD=bin/bench
+mkdir -p $BUILD
+gcc -Wall -O2 -o $BUILD/stuffing_bench bench/stuffing_bench.c src/stuffing.c -Iinclude -pthread
+./$BUILD/stuffing_bench
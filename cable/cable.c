@@ -1,26 +1,68 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates pairs of virtual Tx / Rx serial ports using "socat".
+//
+// Each direction emulates a line: bytes go on the wire one after the other
+// at the line rate (bits per byte / baud), arrive after the propagation
+// delay and may have bits flipped on the way, either independently (bit
+// error rate) or in bursts (Gilbert-Elliott: a good and a bad state, each
+// with its own bit error rate). A sender faster than the line is held back
+// in its own tty buffer, as a real UART would hold it.
+//
+// Everything waits in one epoll: the ports, stdin and a timerfd per line
+// that fires when its next byte arrives or the wire has room again. With
+// no rate limit, delay or errors the line is only a relay, and bytes are
+// spliced through a pipe without being copied to the program.
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 // Baudrate settings are defined in <asm/termbits.h>, which is
 // included by <termios.h>
 #define BAUDRATE B38400
-#define _POSIX_SOURCE 1 // POSIX compliant source
 #define FALSE 0
 #define TRUE 1
 
-#define BUF_SIZE 2048
+#define BUF_SIZE 65536
+
+// Cable pairs: pair 0 is /dev/ttyS10 (Tx) and /dev/ttyS11 (Rx), pair i
+// /dev/ttyS(10 + 2i) and /dev/ttyS(11 + 2i).
+#define MAX_PAIRS 16
+#define FIRST_PORT 10
+
+// Bytes a line holds on the wire and in flight; enough for 4 Mbaud with
+// half a second of delay.
+#define LINE_QUEUE (1 << 18)
+
+// Backlog (ns of wire time) the cable takes from a sender before leaving
+// the rest in its tty buffer.
+#define SEND_AHEAD_NS 2000000LL
+
+// How long a port whose other side is closed is left alone before reading
+// it again.
+#define HANGUP_RETRY_NS 100000000LL
+
+// Arrivals are handed over on this tick, so a fast line wakes the cable
+// once per tick rather than once per byte.
+#define DELIVERY_TICK_NS 1000000LL
+
+// What woke a line up, in the low bits of its epoll event pointer.
+#define LINE_INPUT 0
+#define LINE_TIMER 1
+#define LINE_OUTPUT 2
 
 typedef enum
 {
@@ -29,10 +71,424 @@ typedef enum
     CableModeNoise,
 } CableMode;
 
+typedef struct
+{
+    int baudRate;        // 0 = no rate limit
+    int bitsPerByte;     // start + data + parity + stop bits on the wire
+    int delayMs;         // one-way propagation delay
+    double ber;          // bit error rate (good state)
+    double burstEnter;   // per bit chance of going from good to bad
+    double burstLeave;   // per bit chance of going from bad to good
+    double burstBer;     // bit error rate in the bad state
+    unsigned long long seed;
+} LineSettings;
+
+typedef struct
+{
+    char name[32];
+    int fdFrom;
+    int fdTo;
+    int fdOut;                 // fdTo again, to wait for room on its own
+    int timerFd;
+    int pipe[2];               // splice path, -1 when splice is not possible
+    int piped;                 // bytes in the pipe the far end did not take
+    int reading;               // waiting for input on fdFrom
+    int blocked;               // waiting for room on fdOut
+    long long retryAt;         // ns, when to read a closed port again
+    int detached;              // ports out of the epoll set until retryAt
+    unsigned char *data;       // LINE_QUEUE bytes
+    long long *due;            // ns, when each byte has reached the far end
+    unsigned long head;        // bytes queued so far
+    unsigned long tail;        // bytes delivered so far
+    long long lineFree;        // ns, when the last queued byte is on the wire
+    int burst;                 // TRUE while in the bad state
+    unsigned long long prng;   // this line's error generator
+
+    // counters, printed by "stats"
+    unsigned long bytes;
+    unsigned long bytesSpliced;
+    unsigned long bytesDropped;
+    unsigned long bitsFlipped;
+    unsigned long reads;
+} Line;
+
+typedef struct
+{
+    int fdTx;
+    int fdRx;
+    struct termios oldtioTx;
+    struct termios oldtioRx;
+    Line tx2rx;
+    Line rx2tx;
+} CablePair;
+
+static LineSettings settings = {0, 10, 0, 0, 0, 0, 0.5, 1};
+static CableMode cableMode = CableModeOn;
+
+long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// splitmix64, so a seed gives the same errors on every run; each line has
+// its own state, so pairs running side by side do not disturb each other
+unsigned long long nextRandom(Line *line)
+{
+    unsigned long long z = (line->prng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// TRUE with probability p
+int chance(Line *line, double p)
+{
+    return p > 0 && (nextRandom(line) >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+long long byteTimeNs()
+{
+    if (settings.baudRate <= 0)
+        return 0;
+    return settings.bitsPerByte * 1000000000LL / settings.baudRate;
+}
+
+// TRUE when the line only has to relay bytes
+int lineIsClean()
+{
+    return cableMode == CableModeOn && settings.baudRate <= 0 && settings.delayMs <= 0 &&
+           settings.ber <= 0 && settings.burstEnter <= 0;
+}
+
+// Flip bits of a byte going over the line, as the error model says.
+unsigned char addLineErrors(Line *line, unsigned char byte)
+{
+    int bursts = settings.burstEnter > 0;
+    if (settings.ber <= 0 && !bursts)
+        return byte;
+
+    for (int bit = 0; bit < 8; bit++)
+    {
+        if (bursts)
+            line->burst = line->burst ? !chance(line, settings.burstLeave) : chance(line, settings.burstEnter);
+        if (chance(line, line->burst ? settings.burstBer : settings.ber))
+        {
+            byte ^= 1 << bit;
+            line->bitsFlipped++;
+        }
+    }
+    return byte;
+}
+
+// Add noise to a buffer, by flipping the byte in the "errorIndex" position.
+void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
+{
+    buf[errorIndex] ^= 0xFF;
+}
+
+// Put size bytes on the line, each after the one before it.
+void sendOnLine(Line *line, const unsigned char *buf, int size)
+{
+    long long now = nowNs();
+    long long byteTime = byteTimeNs();
+    if (line->lineFree < now)
+        line->lineFree = now;
+
+    for (int i = 0; i < size; i++)
+    {
+        unsigned long at = line->head % LINE_QUEUE;
+        line->lineFree += byteTime;
+        line->data[at] = addLineErrors(line, buf[i]);
+        line->due[at] = line->lineFree + settings.delayMs * 1000000LL;
+        line->head++;
+    }
+    line->bytes += size;
+}
+
+// Bytes the line takes from its sender now; 0 while the wire is busy.
+int lineRoom(Line *line)
+{
+    if (line->lineFree - nowNs() > SEND_AHEAD_NS)
+        return 0;
+    int room = LINE_QUEUE - (line->head - line->tail);
+    return room < BUF_SIZE ? room : BUF_SIZE;
+}
+
+// Hand the bytes that arrived to the far end.
+// Returns FALSE while the far end takes no more and some are due.
+int deliverFromLine(Line *line)
+{
+    long long now = nowNs();
+    while (line->tail != line->head)
+    {
+        unsigned long end = line->tail;
+        while (end != line->head && line->due[end % LINE_QUEUE] <= now &&
+               (end == line->tail || end % LINE_QUEUE != 0))
+            end++;
+        if (end == line->tail)
+            return TRUE;
+
+        int bytesOut = write(line->fdTo, line->data + line->tail % LINE_QUEUE, end - line->tail);
+        if (bytesOut < 0 && errno == EAGAIN)
+            return FALSE;
+        if (bytesOut <= 0)
+        {
+            // nobody on the far end: the bytes fall off the cable
+            line->bytesDropped += end - line->tail;
+            bytesOut = end - line->tail;
+        }
+        line->tail += bytesOut;
+    }
+    return TRUE;
+}
+
+// The far end does not splice: queue what is left in the pipe, already
+// arrived, and copy from now on.
+void stopSplicing(Line *line)
+{
+    unsigned char buf[BUF_SIZE];
+    int bytes = line->piped > 0 ? read(line->pipe[0], buf, sizeof(buf)) : 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        unsigned long at = line->head % LINE_QUEUE;
+        line->data[at] = buf[i];
+        line->due[at] = 0;
+        line->head++;
+    }
+    line->piped = 0;
+
+    close(line->pipe[0]);
+    close(line->pipe[1]);
+    line->pipe[0] = line->pipe[1] = -1;
+}
+
+// Write what waits in the splice pipe to the far end.
+// Returns FALSE while the far end takes no more.
+int drainPipe(Line *line)
+{
+    while (line->piped > 0)
+    {
+        ssize_t out = splice(line->pipe[0], NULL, line->fdTo, NULL, line->piped,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (out < 0 && errno == EAGAIN)
+            return FALSE;
+        if (out <= 0)
+        {
+            stopSplicing(line);
+            return TRUE;
+        }
+        line->piped -= out;
+    }
+    return TRUE;
+}
+
+// Sets up the line's next wakeups: input while the wire has room, output
+// while the far end is full, and the timer for the next arrival, for when
+// the wire has room again or for when a closed port is tried again.
+void updateLine(int epollFd, Line *line, int blocked)
+{
+    long long now = nowNs();
+    int reading = !blocked && now >= line->retryAt && lineRoom(line) > 0;
+
+    // a held back sender waits in its tty buffer, not in a busy epoll
+    if (reading != line->reading && !line->detached)
+    {
+        struct epoll_event event = {.events = reading ? EPOLLIN : 0, .data.ptr = line};
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, line->fdFrom, &event);
+        line->reading = reading;
+    }
+    if (blocked != line->blocked && !line->detached)
+    {
+        struct epoll_event event = {.events = blocked ? EPOLLOUT : 0, .data.ptr = (char *)line + LINE_OUTPUT};
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, line->fdOut, &event);
+        line->blocked = blocked;
+    }
+
+    long long at = 0;
+    if (!blocked && line->tail != line->head)
+    {
+        at = line->due[line->tail % LINE_QUEUE];
+        at += DELIVERY_TICK_NS - 1 - (at + DELIVERY_TICK_NS - 1) % DELIVERY_TICK_NS;
+    }
+    if (!reading)
+    {
+        // a full queue only has room after the next arrival, above
+        long long room = 0;
+        if (!blocked && line->lineFree - now > SEND_AHEAD_NS)
+            room = line->lineFree - SEND_AHEAD_NS;
+        if (line->retryAt > now && line->retryAt > room)
+            room = line->retryAt;
+        if (room > 0 && (at == 0 || room < at))
+            at = room;
+    }
+
+    struct itimerspec timer = {0};
+    if (at > 0 || (!blocked && line->tail != line->head))
+    {
+        if (at <= 0)
+            at = 1;
+        timer.it_value.tv_sec = at / 1000000000;
+        timer.it_value.tv_nsec = at % 1000000000;
+    }
+    timerfd_settime(line->timerFd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+// A closed port reports a hangup whatever it is waited for, so its
+// descriptors leave the epoll set until the line tries it again.
+void detachLine(int epollFd, Line *line)
+{
+    if (!line->detached)
+    {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, line->fdFrom, NULL);
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, line->fdOut, NULL);
+        line->detached = TRUE;
+        line->reading = FALSE;
+        line->blocked = FALSE;
+    }
+    line->retryAt = nowNs() + HANGUP_RETRY_NS;
+    updateLine(epollFd, line, FALSE);
+}
+
+void attachLine(int epollFd, Line *line)
+{
+    struct epoll_event event = {.events = 0, .data.ptr = line};
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, line->fdFrom, &event);
+    event.data.ptr = (char *)line + LINE_OUTPUT;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, line->fdOut, &event);
+    line->detached = FALSE;
+}
+
+// Reads what the sender wrote (when the wire has room) and delivers what
+// arrived. With nothing to emulate the bytes are spliced through a pipe.
+void serviceLine(int epollFd, Line *line)
+{
+    static unsigned char buf[BUF_SIZE];
+
+    // what the far end did not take yet goes first
+    int blocked = !drainPipe(line) || !deliverFromLine(line);
+    int room = blocked || nowNs() < line->retryAt ? 0 : lineRoom(line);
+
+    int bytesFrom = -1;
+    int spliced = FALSE;
+    errno = EAGAIN;
+    if (room > 0 && lineIsClean() && line->tail == line->head && line->pipe[0] >= 0)
+    {
+        bytesFrom = splice(line->fdFrom, NULL, line->pipe[1], NULL, room,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        spliced = bytesFrom >= 0 || errno == EAGAIN;
+        if (!spliced)
+            stopSplicing(line);
+    }
+    if (room > 0 && !spliced)
+        bytesFrom = read(line->fdFrom, buf, room);
+
+    if (bytesFrom > 0)
+    {
+        line->reads++;
+        if (spliced)
+        {
+            line->piped += bytesFrom;
+            line->bytes += bytesFrom;
+            line->bytesSpliced += bytesFrom;
+        }
+        else if (cableMode == CableModeOff)
+        {
+            line->bytesDropped += bytesFrom;
+        }
+        else
+        {
+            if (cableMode == CableModeNoise)
+            {
+                addNoiseToBuffer(buf, 0);
+            }
+
+            sendOnLine(line, buf, bytesFrom);
+        }
+        blocked = !drainPipe(line) || !deliverFromLine(line);
+    }
+    else if (room > 0 && (bytesFrom == 0 || errno != EAGAIN))
+    {
+        // the sender's end is closed; look again later instead of spinning
+        line->retryAt = nowNs() + HANGUP_RETRY_NS;
+    }
+
+    updateLine(epollFd, line, blocked);
+}
+
+void printSettings()
+{
+    printf("Line: %d baud (%s), %d bits per byte, %d ms delay, BER %g",
+           settings.baudRate, settings.baudRate > 0 ? "limited" : "unlimited",
+           settings.bitsPerByte, settings.delayMs, settings.ber);
+    if (settings.burstEnter > 0)
+        printf(", bursts %g / %g with BER %g", settings.burstEnter,
+               settings.burstLeave, settings.burstBer);
+    printf(", seed %llu\n", settings.seed);
+}
+
+void printStats(CablePair *pairs, int nPairs)
+{
+    for (int i = 0; i < nPairs; i++)
+    {
+        Line *lines[2] = {&pairs[i].tx2rx, &pairs[i].rx2tx};
+        for (int j = 0; j < 2; j++)
+            printf("%s: %lu bytes (%lu spliced), %lu dropped, %lu bits flipped, %lu reads\n",
+                   lines[j]->name, lines[j]->bytes, lines[j]->bytesSpliced,
+                   lines[j]->bytesDropped, lines[j]->bitsFlipped, lines[j]->reads);
+    }
+}
+
+// Each line's generator starts from the seed and the line's position.
+void seedLines(CablePair *pairs, int nPairs)
+{
+    for (int i = 0; i < nPairs; i++)
+    {
+        pairs[i].tx2rx.prng = settings.seed + 2 * i;
+        pairs[i].rx2tx.prng = settings.seed + 2 * i + 1;
+    }
+}
+
+// Apply one "name value..." setting, from the command line or the console.
+// Returns TRUE when it was understood.
+int applySetting(const char *command)
+{
+    char name[32] = {0};
+    char value[32] = {0};
+    double a, b, c;
+    if (sscanf(command, "%31s %31s", name, value) < 1)
+        return FALSE;
+
+    if (strcmp(name, "rate") == 0 && sscanf(value, "%lf", &a) == 1 && a >= 0)
+        settings.baudRate = (int)a;
+    else if (strcmp(name, "bits") == 0 && sscanf(value, "%lf", &a) == 1 && a >= 1)
+        settings.bitsPerByte = (int)a;
+    else if (strcmp(name, "delay") == 0 && sscanf(value, "%lf", &a) == 1 && a >= 0)
+        settings.delayMs = (int)a;
+    else if (strcmp(name, "ber") == 0 && sscanf(value, "%lf", &a) == 1 && a >= 0 && a <= 1)
+        settings.ber = a;
+    else if (strcmp(name, "burst") == 0 && strcmp(value, "off") == 0)
+        settings.burstEnter = 0;
+    else if (strcmp(name, "burst") == 0 &&
+             sscanf(command, "%*s %lf %lf %lf", &a, &b, &c) == 3 &&
+             a >= 0 && a <= 1 && b > 0 && b <= 1 && c >= 0 && c <= 1)
+    {
+        settings.burstEnter = a;
+        settings.burstLeave = b;
+        settings.burstBer = c;
+    }
+    else if (strcmp(name, "seed") == 0 && sscanf(value, "%llu", &settings.seed) == 1)
+        ;
+    else
+        return FALSE;
+    return TRUE;
+}
+
 // Returns: serial port file descriptor (fd).
 int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
 {
-    int fd = open(serialPort, O_RDWR | O_NOCTTY);
+    int fd = open(serialPort, O_RDWR | O_NOCTTY | O_NONBLOCK);
 
     if (fd < 0)
         return -1;
@@ -46,7 +502,7 @@ int openSerialPort(const char *serialPort, struct termios *oldtio, struct termio
     newtio->c_iflag = IGNPAR;
     newtio->c_oflag = 0;
     newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 1; // Inter-character timer unused
+    newtio->c_cc[VTIME] = 0; // Inter-character timer unused, epoll waits
     newtio->c_cc[VMIN] = 0;  // Read without blocking
     tcflush(fd, TCIOFLUSH);
 
@@ -56,118 +512,214 @@ int openSerialPort(const char *serialPort, struct termios *oldtio, struct termio
     return fd;
 }
 
-// Add noise to a buffer, by flipping the byte in the "errorIndex" position.
-void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
+// Names of pair i's ports: the one the program opens and the emulator end.
+void portNames(int i, int rx, char *port, char *emulator)
 {
-    buf[errorIndex] ^= 0xFF;
+    sprintf(port, "/dev/ttyS%d", FIRST_PORT + 2 * i + rx);
+    if (i == 0)
+        sprintf(emulator, "/dev/emulator%s", rx ? "Rx" : "Tx");
+    else
+        sprintf(emulator, "/dev/emulator%s%d", rx ? "Rx" : "Tx", i);
 }
 
-int main(int argc, char *argv[])
+// Start socat for a port and wait until its links show up. Links left by
+// an earlier run are removed first, or they would pass for the new ones.
+void createPort(const char *port, const char *emulator)
 {
+    char command[256];
+    unlink(port);
+    unlink(emulator);
+    sprintf(command, "socat -dd PTY,link=%s,mode=777 PTY,link=%s,mode=777 &", port, emulator);
+    system(command);
+    for (int tries = 0; tries < 500 && (access(port, F_OK) != 0 || access(emulator, F_OK) != 0); tries++)
+        usleep(10000);
     printf("\n");
+}
+
+void openLine(int epollFd, Line *line, const char *name, int fdFrom, int fdTo)
+{
+    snprintf(line->name, sizeof(line->name), "%s", name);
+    line->fdFrom = fdFrom;
+    line->fdTo = fdTo;
+    line->fdOut = dup(fdTo);
+    line->data = malloc(LINE_QUEUE);
+    line->due = malloc(LINE_QUEUE * sizeof(long long));
+    line->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (pipe2(line->pipe, O_NONBLOCK) != 0)
+        line->pipe[0] = line->pipe[1] = -1;
+    if (line->data == NULL || line->due == NULL || line->timerFd < 0 || line->fdOut < 0)
+    {
+        perror("Opening the emulated line");
+        exit(-1);
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = line};
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fdFrom, &event);
+    line->reading = TRUE;
+    event.data.ptr = (char *)line + LINE_TIMER;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, line->timerFd, &event);
+    event.events = 0;
+    event.data.ptr = (char *)line + LINE_OUTPUT;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, line->fdOut, &event);
+}
+
+int main(int argc, char *argv[])
+{
+    int nPairs = 1;
+
+    // --name value... on the command line, as the console commands
+    settings.seed = time(NULL);
+    for (int i = 1; i < argc; i++)
+    {
+        char command[128] = {0};
+        if (strncmp(argv[i], "--", 2) != 0)
+            continue;
+        strncat(command, argv[i] + 2, sizeof(command) - 1);
+        for (int j = i + 1; j < argc && strncmp(argv[j], "--", 2) != 0; j++)
+        {
+            strncat(command, " ", sizeof(command) - strlen(command) - 1);
+            strncat(command, argv[j], sizeof(command) - strlen(command) - 1);
+        }
+        if (sscanf(command, "pairs %d", &nPairs) == 1 && nPairs >= 1 && nPairs <= MAX_PAIRS)
+            continue;
+        if (!applySetting(command))
+        {
+            printf("Usage: %s [--pairs n] [--rate baud] [--bits n] [--delay ms] [--ber p]\n"
+                   "          [--burst enter leave ber] [--seed n]\n", argv[0]);
+            exit(1);
+        }
+    }
 
-    system("socat -dd PTY,link=/dev/ttyS10,mode=777 PTY,link=/dev/emulatorTx,mode=777 &");
-    sleep(1);
     printf("\n");
 
-    system("socat -dd PTY,link=/dev/ttyS11,mode=777 PTY,link=/dev/emulatorRx,mode=777 &");
-    sleep(1);
+    char port[64];
+    char emulator[64];
+    for (int i = 0; i < nPairs; i++)
+    {
+        for (int rx = 0; rx < 2; rx++)
+        {
+            portNames(i, rx, port, emulator);
+            createPort(port, emulator);
+        }
+    }
 
-    printf("\n\n"
-           "Transmitter must open /dev/ttyS10\n"
-           "Receiver must open /dev/ttyS11\n"
-           "\n"
+    printf("\n\n");
+    for (int i = 0; i < nPairs; i++)
+    {
+        portNames(i, 0, port, emulator);
+        printf("Transmitter %d must open %s\n", i, port);
+        portNames(i, 1, port, emulator);
+        printf("Receiver %d must open %s\n", i, port);
+    }
+    printf("\n"
            "The cable program is sensible to the following interactive commands:\n"
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
            "--- noise        : add fixed noise to the cable\n"
+           "--- rate <baud>  : line rate, 0 for no limit\n"
+           "--- bits <n>     : bits on the wire per byte (default 10, 8N1)\n"
+           "--- delay <ms>   : one-way propagation delay\n"
+           "--- ber <p>      : random bit error rate\n"
+           "--- burst <enter> <leave> <ber> | burst off\n"
+           "                 : Gilbert-Elliott burst errors, per bit chances of\n"
+           "                   entering / leaving the bad state and its error rate\n"
+           "--- seed <n>     : restart the error generators\n"
+           "--- stats        : bytes carried, dropped and bits flipped per line\n"
            "--- end          : terminate the program\n"
            "\n");
+    printSettings();
 
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
-
-    int fdTx = openSerialPort("/dev/emulatorTx", &oldtioTx, &newtioTx);
+    int epollFd = epoll_create1(0);
+    if (epollFd < 0)
+    {
+        perror("epoll_create1");
+        exit(-1);
+    }
 
-    if (fdTx < 0)
+    // Configure serial ports
+    CablePair *pairs = calloc(nPairs, sizeof(CablePair));
+    if (pairs == NULL)
     {
-        perror("Opening Tx emulator serial port");
+        perror("calloc");
         exit(-1);
     }
+    for (int i = 0; i < nPairs; i++)
+    {
+        struct termios newtio;
+        CablePair *pair = &pairs[i];
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
+        portNames(i, 0, port, emulator);
+        pair->fdTx = openSerialPort(emulator, &pair->oldtioTx, &newtio);
 
-    int fdRx = openSerialPort("/dev/emulatorRx", &oldtioRx, &newtioRx);
+        if (pair->fdTx < 0)
+        {
+            perror("Opening Tx emulator serial port");
+            exit(-1);
+        }
 
-    if (fdRx < 0)
-    {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
+        portNames(i, 1, port, emulator);
+        pair->fdRx = openSerialPort(emulator, &pair->oldtioRx, &newtio);
+
+        if (pair->fdRx < 0)
+        {
+            perror("Opening Rx emulator serial port");
+            exit(-1);
+        }
+
+        char name[32];
+        sprintf(name, "%d: Tx > Rx", i);
+        openLine(epollFd, &pair->tx2rx, name, pair->fdTx, pair->fdRx);
+        sprintf(name, "%d: Rx > Tx", i);
+        openLine(epollFd, &pair->rx2tx, name, pair->fdRx, pair->fdTx);
     }
+    seedLines(pairs, nPairs);
 
     // Configure stdin to receive commands to this program
     int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
     fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+    struct epoll_event stdinEvent = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &stdinEvent);
 
-    unsigned char tx2rx[BUF_SIZE] = {0};
-    unsigned char rx2tx[BUF_SIZE] = {0};
     char rxStdin[BUF_SIZE] = {0};
-
-    CableMode cableMode = CableModeOn;
     volatile int STOP = FALSE;
 
     printf("Cable ready\n");
+    fflush(stdout);
 
     while (STOP == FALSE)
     {
-        // Read from Tx
-        int bytesFromTx = read(fdTx, tx2rx, BUF_SIZE);
+        struct epoll_event events[6 * MAX_PAIRS + 1];
+        int ready = epoll_wait(epollFd, events, 6 * MAX_PAIRS + 1, -1);
 
-        if (bytesFromTx > 0)
+        for (int e = 0; e < ready; e++)
         {
-            if (cableMode == CableModeOff)
+            if (events[e].data.ptr != NULL)
             {
-                printf("bytesFromTx=%d > bytesToRx=CONNECTION OFF\n", bytesFromTx);
-            }
-            else
-            {
-                if (cableMode == CableModeNoise)
+                // port input or output, or the line's timer
+                unsigned long ptr = (unsigned long)events[e].data.ptr;
+                Line *line = (Line *)(ptr & ~3UL);
+                if ((ptr & 3) == LINE_TIMER)
                 {
-                    addNoiseToBuffer(tx2rx, 0);
+                    unsigned long long expirations;
+                    read(line->timerFd, &expirations, sizeof(expirations));
+                    if (line->detached && nowNs() >= line->retryAt)
+                        attachLine(epollFd, line);
                 }
-
-                int bytesToRx = write(fdRx, tx2rx, bytesFromTx);
-                printf("bytesFromTx=%d > bytesToRx=%d\n", bytesFromTx, bytesToRx);
-            }
-        }
-
-        // Read from Rx
-        int bytesFromRx = read(fdRx, rx2tx, BUF_SIZE);
-
-        if (bytesFromRx > 0)
-        {
-            if (cableMode == CableModeOff)
-            {
-                printf("bytesToTx=CONNECTION OFF < bytesFromRx=%d\n", bytesFromRx);
-            }
-            else
-            {
-                if (cableMode == CableModeNoise)
+                else if (events[e].events & (EPOLLHUP | EPOLLERR))
                 {
-                    addNoiseToBuffer(rx2tx, 0);
+                    detachLine(epollFd, line);
+                    continue;
                 }
-
-                int bytesToTx = write(fdTx, rx2tx, bytesFromRx);
-                printf("bytesToTx=%d < bytesFromRx=%d\n", bytesToTx, bytesFromRx);
+                serviceLine(epollFd, line);
+                continue;
             }
-        }
 
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
-        {
+            // Read commands from STDIN to control the cable mode
+            int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE - 1);
+            if (fromStdin == 0)
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            if (fromStdin <= 0)
+                continue;
             rxStdin[fromStdin - 1] = '\0';
 
             if (strcmp(rxStdin, "off") == 0 || strcmp(rxStdin, "0") == 0)
@@ -185,30 +737,42 @@ int main(int argc, char *argv[])
                 printf("CONNECTION NOISE\n");
                 cableMode = CableModeNoise;
             }
+            else if (strcmp(rxStdin, "stats") == 0)
+            {
+                printStats(pairs, nPairs);
+            }
             else if (strcmp(rxStdin, "end") == 0)
             {
                 printf("END OF THE PROGRAM\n");
                 STOP = TRUE;
             }
+            else if (applySetting(rxStdin))
+            {
+                // only a new seed restarts the error generators
+                if (strncmp(rxStdin, "seed", 4) == 0)
+                    seedLines(pairs, nPairs);
+                printSettings();
+            }
+            fflush(stdout);
         }
     }
 
+    printStats(pairs, nPairs);
+
     // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
+    for (int i = 0; i < nPairs; i++)
     {
-        perror("tcsetattr");
-        exit(-1);
-    }
+        if (tcsetattr(pairs[i].fdRx, TCSANOW, &pairs[i].oldtioRx) == -1 ||
+            tcsetattr(pairs[i].fdTx, TCSANOW, &pairs[i].oldtioTx) == -1)
+        {
+            perror("tcsetattr");
+            exit(-1);
+        }
 
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
-    {
-        perror("tcsetattr");
-        exit(-1);
+        close(pairs[i].fdTx);
+        close(pairs[i].fdRx);
     }
 
-    close(fdTx);
-    close(fdRx);
-
     system("killall socat");
 
     return 0;
@@ -0,0 +1,57 @@
+// Ordered chunk worker pool header.
+
+#ifndef _CHUNK_POOL_H_
+#define _CHUNK_POOL_H_
+
+// Most worker threads and chunks in flight in a pool.
+#define MAX_POOL_WORKERS 32
+#define MAX_POOL_DEPTH (2 * MAX_POOL_WORKERS + 2)
+
+// Worker count asking for one thread per online core.
+#define POOL_PER_CORE -1
+
+// Turn the size bytes of in into out (capacity bytes), using scratch, a
+// private block of the pool's scratch size; arg is what pool_submit() got.
+// The return value is handed back untouched by pool_wait().
+typedef int (*ChunkJob)(void *scratch, const unsigned char *in, int size,
+                        int arg, unsigned char *out);
+
+typedef struct
+{
+    const unsigned char *in;
+    int in_size;
+    unsigned char *out;
+    int result;  // what the job returned
+} ChunkResult;
+
+typedef struct ChunkPool ChunkPool;
+
+// Start a pool running job on workers threads (POOL_PER_CORE for one per
+// core, 0 to run each job inside pool_submit()). Chunks in and out take up
+// to capacity bytes; each worker gets scratch_size bytes of scratch.
+// Return the pool, or NULL on error.
+ChunkPool *pool_create(int workers, int capacity, int scratch_size,
+                       ChunkJob job);
+
+// Return the buffer to fill with the next chunk, or NULL when every slot
+// is in flight (pool_wait() and pool_release() the oldest first).
+unsigned char *pool_input(ChunkPool *pool);
+
+// Queue the chunk of size bytes written to pool_input()'s buffer.
+void pool_submit(ChunkPool *pool, int size, int arg);
+
+// Return the number of chunks submitted and not yet released.
+int pool_pending(ChunkPool *pool);
+
+// Wait for the oldest pending chunk. Results come back in the order the
+// chunks were submitted and stay valid until pool_release().
+// Return "-1" when nothing is pending.
+int pool_wait(ChunkPool *pool, ChunkResult *result);
+
+// Hand the oldest chunk's slot back for a new chunk.
+void pool_release(ChunkPool *pool);
+
+// Stop the workers and free the pool.
+void pool_destroy(ChunkPool *pool);
+
+#endif // _CHUNK_POOL_H_
@@ -0,0 +1,34 @@
+// Chunk compression header.
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+// Compression codecs, as negotiated in LinkLayer.compression.
+#define COMPRESS_NONE 0
+#define COMPRESS_LZ 1 // LZ77 in the LZ4 block format
+
+// Largest chunk lz_compress() takes.
+#define LZ_MAX_INPUT 65536
+#define LZ_HASH_BITS 13
+
+// Match finder tables; large, so the caller provides them (one per thread).
+typedef struct
+{
+    int head[1 << LZ_HASH_BITS];
+    int chain[LZ_MAX_INPUT];
+} LzState;
+
+// Compress size bytes of in into out, which holds capacity bytes.
+// level 1 takes the first match found and skips ahead quickly over data
+// that does not compress; higher levels search longer hash chains for
+// better ratio.
+// Return the compressed size, or 0 when it does not fit in capacity.
+int lz_compress(LzState *state, const unsigned char *in, int size,
+                unsigned char *out, int capacity, int level);
+
+// Decompress size bytes of in into out, which holds capacity bytes.
+// Return the decompressed size, or -1 when the input is malformed.
+int lz_decompress(const unsigned char *in, int size, unsigned char *out,
+                  int capacity);
+
+#endif // _COMPRESS_H_
@@ -0,0 +1,50 @@
+// Asynchronous receive file writer header.
+
+#ifndef _DISK_WRITER_H_
+#define _DISK_WRITER_H_
+
+// Data is staged in a DISK_RING byte ring and written to the file in
+// DISK_BLOCK writes at DISK_BLOCK aligned offsets.
+#define DISK_BLOCK (256 * 1024)
+#define DISK_RING (16 * DISK_BLOCK)
+
+typedef enum
+{
+    SyncNever,     // leave it to the kernel
+    SyncAtClose,   // fsync once the whole file is written
+    SyncPeriodic,  // fdatasync every sync_every bytes, and at close
+} SyncPolicy;
+
+// Called from the writer thread after each sync with the bytes now
+// durable and their CRC-32C (fcs_update() state, not finalized).
+typedef void (*DiskSynced)(void *arg, long offset, unsigned int crc);
+
+typedef struct
+{
+    long size;         // expected file size to preallocate, 0 = unknown
+    long offset;       // bytes already in the file to append to (resume)
+    unsigned int crc;  // their CRC-32C state, as DiskSynced reported it
+    SyncPolicy policy;
+    long sync_every;   // SyncPeriodic interval in bytes
+    DiskSynced synced; // may be NULL
+    void *arg;
+} DiskOptions;
+
+typedef struct DiskWriter DiskWriter;
+
+// Open pathname, dropping anything past options->offset (creating or
+// emptying it when that is 0), and start its writer thread. A known size
+// is preallocated so the file does not fragment as it grows.
+// Return the writer, or NULL on error.
+DiskWriter *disk_open(const char *pathname, const DiskOptions *options);
+
+// Queue size bytes to be appended to the file. Only waits when the ring
+// is full, i.e. when the disk falls a whole ring behind.
+// Return "1" on success or "-1" once a write failed.
+int disk_put(DiskWriter *disk, const unsigned char *data, int size);
+
+// Write out what is queued, sync as the policy asks and close the file.
+// Return "1" on success or "-1" if any write failed.
+int disk_close(DiskWriter *disk);
+
+#endif // _DISK_WRITER_H_
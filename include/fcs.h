@@ -0,0 +1,24 @@
+// Frame check sequence header.
+
+#ifndef _FCS_H_
+#define _FCS_H_
+
+#include "link_layer.h"
+
+// Largest FCS on the wire, in bytes.
+#define MAX_FCS_SIZE 4
+
+// Return the number of FCS bytes sent after the data field.
+int fcs_size(LinkFcsType type);
+
+// Return the starting value of a running FCS.
+unsigned int fcs_init(LinkFcsType type);
+
+// Fold size bytes of buf into the running FCS and return it.
+unsigned int fcs_update(LinkFcsType type, unsigned int fcs,
+                        const unsigned char *buf, int size);
+
+// Write the final FCS into out (fcs_size() bytes, least significant first).
+void fcs_put(LinkFcsType type, unsigned int fcs, unsigned char *out);
+
+#endif // _FCS_H_
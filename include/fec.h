@@ -0,0 +1,27 @@
+// Forward error correction header.
+
+#ifndef _FEC_H_
+#define _FEC_H_
+
+// Most parity bytes a Reed-Solomon codeword may carry.
+#define MAX_FEC_PARITY 32
+
+// Return the number of codewords a size byte block is split into.
+int fec_codewords(int size, int parity, int interleave);
+
+// Return the length of a size byte block once its parity is appended.
+int fec_encoded_size(int size, int parity, int interleave);
+
+// Append Reed-Solomon parity to the size bytes of buf (which must hold
+// fec_encoded_size() bytes). The block is split into interleaved RS(255)
+// codewords, byte i going to codeword i % fec_codewords(), so a burst on
+// the line is spread over all of them. Each codeword corrects up to
+// parity / 2 bad bytes; interleave is the least number of codewords.
+// Return the encoded length.
+int fec_encode(unsigned char *buf, int size, int parity, int interleave);
+
+// Correct the size bytes of an encoded block in place.
+// Return the length of the original block, or -1 when it is beyond repair.
+int fec_decode(unsigned char *buf, int size, int parity, int interleave);
+
+#endif // _FEC_H_
@@ -0,0 +1,40 @@
+// Transmit file source header.
+
+#ifndef _FILE_SOURCE_H_
+#define _FILE_SOURCE_H_
+
+#include <stdio.h>
+
+// How far ahead of the reader the kernel is asked to fetch a mapped file.
+#define SOURCE_READAHEAD (1 << 20)
+
+typedef struct
+{
+    const unsigned char *map;  // the whole file, or NULL when streaming
+    FILE *file;                // streaming fallback (pipes, devices, empty files)
+    long size;                 // from fstat, 0 when unknown
+    long mtime;                // from fstat, 0 when unknown
+    long offset;               // position of the next read
+    long advised;              // mapped bytes the kernel was asked to fetch
+    int eof;
+} FileSource;
+
+// Open pathname for reading. Regular files are mapped and read straight
+// from the page cache; anything else is read through stdio.
+// Return "1" on success or "-1" on error.
+int source_open(FileSource *src, const char *pathname);
+
+// Copy the next size bytes (fewer at the end of the file) into out.
+// Return the number of bytes copied.
+int source_read(FileSource *src, unsigned char *out, int size);
+
+// Continue reading at offset. Only mapped files can seek.
+// Return "1" on success or "-1" on error.
+int source_seek(FileSource *src, long offset);
+
+// Return TRUE once the whole file was read.
+int source_eof(const FileSource *src);
+
+void source_close(FileSource *src);
+
+#endif // _FILE_SOURCE_H_
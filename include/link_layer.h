@@ -10,35 +10,113 @@ typedef enum
     LlRx,
 } LinkLayerRole;
 
+typedef enum
+{
+    ArqStopAndWait,
+    ArqGoBackN,
+    ArqSelectiveRepeat,
+} LinkArqMode;
+
+typedef enum
+{
+    FcsBcc,   // 1-byte XOR of the data field (BCC2)
+    FcsCrc16, // HDLC FCS-16
+    FcsCrc32, // CRC-32C
+} LinkFcsType;
+
+typedef enum
+{
+    FramingHdlc, // 0x7d escapes, up to twice the frame size
+    FramingCobs, // consistent overhead byte stuffing, one byte in 254
+} LinkFraming;
+
+typedef enum
+{
+    SerialLowLatency = 0x01, // wake the reader per byte (ASYNC_LOW_LATENCY), where the driver allows
+    SerialRtsCts = 0x02,     // RTS/CTS hardware flow control, both ends must be wired for it
+} LinkSerialOption;
+
 typedef struct
 {
-    char serialPort[50];
+    char serialPort[50]; // device, or "pipe:<name>" / "shm:<name>" for an in-process pair (transport.h)
     LinkLayerRole role;
     int baudRate;
     int nRetransmissions;
     int timeout;
+    LinkArqMode arqMode;
+    int windowSize; // I-frames in flight before waiting for RR (1 for stop-and-wait)
+    int seqModulus; // 2, 8 or 128 sequence numbers in the control field
+    LinkFcsType fcsType;
+    LinkFraming framing;
+    int fecMaxParity;  // 0 disables FEC, else the most Reed-Solomon parity bytes per codeword (up to 32)
+    int fecInterleave; // codewords each I-frame is spread over, at least (1 to 255)
+    int maxPayload;    // largest llwrite(), up to MAX_JUMBO_PAYLOAD_SIZE (0 = MAX_PAYLOAD_SIZE)
+    int compression;   // application compression codec, 0 = none
+    int packetVersion; // application packet format, 1 = original
+    long resumeOffset; // receiver: bytes of an interrupted transfer it holds (0 = none), offered in UA
+    unsigned int resumeId; // receiver: the file they belong to; the transmitter reads both from llparameters()
+    int serialOptions; // LinkSerialOption flags
+    int maxBaudRate;   // line rate to step up to after the handshake when both ends offer it, 0 = keep baudRate
 } LinkLayer;
 
 // SIZE of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer
 #define MAX_PAYLOAD_SIZE 1000
 
+// Largest payload a connection may be configured for (LinkLayer.maxPayload).
+#define MAX_JUMBO_PAYLOAD_SIZE 65535
+
 // MISC
 #define FALSE 0
 #define TRUE 1
 
 // Open a connection using the "port" parameters defined in struct linkLayer.
+// The ARQ, FCS, framing, FEC, payload, compression and packet version
+// fields are what this end offers; the SET/UA handshake settles on the
+// best profile both ends support, or on stop-and-wait with BCC2 when the
+// peer does not negotiate.
 // Return fd of the connection when succesful
 // Return "0" or "-1" when unsuccesful
 int llopen(LinkLayer connectionParameters);
 
 // Send data in buf with size bufSize.
-// Return number of chars written, or "-1" on error.
-int llwrite(int fd, const unsigned char *buf, int bufSize, LinkLayer link_struct, int color);
+// The frame is queued in the transmit window; the call only blocks while the
+// window is full. Sequence numbers are tracked by the link layer.
+// Return number of chars written, "0" when the peer stopped acknowledging,
+// or "-1" on error.
+int llwrite(int fd, const unsigned char *buf, int bufSize, LinkLayer link_struct);
+
+// Queue buf to be sent as the next I-frame. A background thread encodes
+// it (FCS, FEC and stuffing) while earlier frames wait for their
+// acknowledgements; llsend() then writes it. Frames go out in the order
+// they were queued, and before anything passed to a later llwrite().
+// Return "1" when queued, "0" when the queue is full (llsend() first) or
+// "-1" on error.
+int llprepare(int fd, const unsigned char *buf, int bufSize);
+
+// Send the oldest frame queued by llprepare(), waiting for room in the
+// window as llwrite() does.
+// Return number of chars written, "0" when the peer stopped answering, or
+// "-1" on error (nothing queued).
+int llsend(int fd);
+
+// Return the payload size llwrite() currently favours. It starts at
+// MAX_PAYLOAD_SIZE (or the connection's maximum when lower), grows while
+// frames get through and shrinks when they are lost; any size up to the
+// connection's maximum is still accepted.
+// Return "-1" on error.
+int llpayload(int fd);
+
+// Copy the profile agreed with the peer into params (the compression field
+// tells which codec the application may use).
+// Return "1" on success or "-1" on error.
+int llparameters(int fd, LinkLayer *params);
 
-// Receive data in packet.
-// Return number of chars read, or "-1" on error.
-int llread(int fd, unsigned char *packet, int last_color);
+// Receive data in packet, in order. packet must hold the connection's
+// maximum payload (LinkLayer.maxPayload, MAX_PAYLOAD_SIZE by default).
+// Return number of chars read, or "-1" on error or when nothing arrived for
+// longer than the transmitter keeps retrying.
+int llread(int fd, unsigned char *packet);
 
 // Close previously opened connection.
 // if showStatistics == TRUE, link layer should print statistics in the console on close.
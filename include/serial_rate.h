@@ -0,0 +1,11 @@
+// Serial line rate header.
+
+#ifndef _SERIAL_RATE_H_
+#define _SERIAL_RATE_H_
+
+// Set the serial port fd to rate baud through termios2 and BOTHER, for
+// rates without a Bxxx constant. Other termios settings are kept.
+// Return "1" on success or "-1" when the port cannot run at that rate.
+int serial_set_any_rate(int fd, int rate);
+
+#endif // _SERIAL_RATE_H_
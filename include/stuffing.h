@@ -0,0 +1,49 @@
+// Byte stuffing kernels header.
+
+#ifndef _STUFFING_H_
+#define _STUFFING_H_
+
+// HDLC flag and escape bytes
+#define F 0x7e
+#define ESC 0x7d
+
+// Return the index of the first F or ESC in buf, or size when there is none.
+int find_special(const unsigned char *buf, int size);
+
+// Return the XOR of all bytes in buf.
+unsigned char xor_bytes(const unsigned char *buf, int size);
+
+// Stuff size bytes of in into out (which must hold 2 * size bytes).
+// Return the number of bytes written to out.
+int stuff_bytes(unsigned char *out, const unsigned char *in, int size);
+
+// Consistent Overhead Byte Stuffing with F as the byte taken out: the data
+// is cut at every F into runs of up to COBS_MAX_RUN bytes, each run sent
+// after a code byte giving its length. The F between two runs is implied,
+// except after a full COBS_MAX_RUN run. Code bytes skip the value F, so
+// data bytes go out unchanged and the overhead is one byte in 254.
+#define COBS_MAX_RUN 254
+
+typedef struct
+{
+    unsigned char *out;
+    int n;        // bytes written to out
+    int code_pos; // where the current run's code byte goes
+    int run;      // length of the current run so far
+} CobsEncoder;
+
+// Start encoding into out (which must hold size + size / COBS_MAX_RUN + 1
+// bytes for size bytes of input).
+void cobs_begin(CobsEncoder *e, unsigned char *out);
+
+// Encode size more bytes of in.
+void cobs_put(CobsEncoder *e, const unsigned char *in, int size);
+
+// Finish the last run.
+// Return the number of bytes written.
+int cobs_end(CobsEncoder *e);
+
+// Return the run length a code byte announces.
+int cobs_run_length(unsigned char code);
+
+#endif // _STUFFING_H_
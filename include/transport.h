@@ -0,0 +1,68 @@
+// Link transport header.
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+// A transport is the byte stream the link layer runs over. Its name picks
+// the backend: a device path is a termios serial port, and
+// TRANSPORT_PIPE "<name>" or TRANSPORT_SHM "<name>" is one end of a pair
+// created in this process by transport_pair() (a socketpair, or a shared
+// memory ring in each direction).
+#define TRANSPORT_PIPE "pipe:"
+#define TRANSPORT_SHM "shm:"
+
+// Line rate of a serial port opened without one, in baud.
+#define DEFAULT_BAUDRATE 38400
+
+// Serial port options for transport_open(); pairs ignore them.
+#define TRANSPORT_LOW_LATENCY 0x01  // ASYNC_LOW_LATENCY, where the driver has it
+#define TRANSPORT_RTS_CTS 0x02      // hardware flow control
+
+// Bytes each shared memory ring holds; a power of two.
+#define SHM_RING_SIZE (256 * 1024)
+
+// Most pairs alive at once.
+#define MAX_TRANSPORT_PAIRS 64
+
+typedef struct Transport Transport;
+
+// Create the pair called name (TRANSPORT_PIPE or TRANSPORT_SHM prefixed),
+// so each of its two ends can be opened once, typically by two threads.
+// It goes away when both ends are closed.
+// Return "1" on success or "-1" on error.
+int transport_pair(const char *name);
+
+// Open name; end picks the end of a pair (0 or 1, ignored for serial
+// ports), rate is the line rate in baud (0 for DEFAULT_BAUDRATE) and
+// flags the TRANSPORT_ serial options.
+// Return the transport, or NULL on error.
+Transport *transport_open(const char *name, int end, int rate, int flags);
+
+// Return the file descriptor poll() can wait on for input. It stays unique
+// while the transport is open.
+int transport_fd(const Transport *t);
+
+// Copy up to size bytes that already arrived into buf, without waiting.
+// Return the number of bytes read (0 when none), or "-1" once the peer is
+// gone or on error.
+int transport_read(Transport *t, unsigned char *buf, int size);
+
+// Write all size bytes of buf, waiting for room when needed.
+// Return size, or "-1" on error.
+int transport_write(Transport *t, const unsigned char *buf, int size);
+
+// Switch to rate baud once everything written so far went out. Pairs
+// have no line rate and accept any.
+// Return "1" on success or "-1" when the port cannot run at that rate.
+int transport_set_rate(Transport *t, int rate);
+
+// Wait up to timeout_ms (-1 forever) for input.
+// Return "1" when there is input (or the peer is gone), "0" on timeout or
+// "-1" on error.
+int transport_wait(Transport *t, int timeout_ms);
+
+// Close the transport, restoring a serial port's settings.
+// Return "1" on success or "-1" on error.
+int transport_close(Transport *t);
+
+#endif // _TRANSPORT_H_
@@ -8,49 +8,304 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "chunk_pool.h"
+#include "compress.h"
+#include "disk_writer.h"
+#include "fcs.h"
+#include "file_source.h"
 #include "link_layer.h"
 
 // defineurile mele
 
-#define BUFSIZE 512
-#define K 128
-#define PACKET_DATA_SIZE 128
+// largest frame payload; the link layer picks the size actually used per
+// frame below it (llpayload()). The 4 byte v1 data packet header limits it
+// to 65535 bytes of file data.
+#define MAX_PAYLOAD 16384
+#define DATA_HEADER_SIZE 4
+#define NAME_SIZE 512
 #define C_START 0x02
 #define C_DATA 0x01
 #define C_END 0x03
+// compressed data packet: C N L2 L1 R2 R1, L the compressed and R the raw
+// length of the file data
+#define C_DATA_LZ 0x04
+#define DATA_LZ_HEADER_SIZE 6
 #define T_SIZE 0x00
 #define T_NAME 0x01
+#define T_MTIME 0x02   // version 2
+#define T_OFFSET 0x03  // version 2, resumed transfers
+
+// packet format offered to the peer (1 or 2). Version 1 counts packets
+// modulo 256 and sends the size in decimal; version 2 packets are
+//   C2_DATA    seq offset data
+//   C2_DATA_LZ seq offset raw_length compressed_data
+//   C2_START / C2_END  T_SIZE size T_NAME L name T_MTIME mtime [T_OFFSET offset]
+// with seq, offset, raw_length, size, mtime and offset as LEB128 varints,
+// so 64 bit files and sequence numbers fit; data runs to the end of the
+// packet. T_OFFSET starts a resumed transfer there.
+#define PACKET_VERSION 2
+#define C2_DATA 0x11
+#define C2_START 0x12
+#define C2_END 0x13
+#define C2_DATA_LZ 0x14
+#define MAX_VARINT 10
+
+// The receiver keeps RX_CHECKPOINT up to date as the file reaches the disk
+// (every SYNC_EVERY bytes with SyncPeriodic, and when it is closed). If
+// the transfer breaks off, the next llopen() offers the transmitter to
+// resume where it stopped; version 2 only.
+#define RX_CHECKPOINT "receive.checkpoint"
+#define CHECKPOINT_MAGIC 0x52534d31  // "RSM1"
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int identity;  // file_identity() of the file being received
+    long size;
+    long offset;            // bytes durably written
+    unsigned int crc;       // CRC-32C state of those bytes
+    char name[NAME_SIZE];   // as the transmitter sent it
+} Checkpoint;
+
+// a START or END packet of either version
+typedef struct
+{
+    long size;
+    long mtime;   // version 2 only
+    long offset;  // version 2, resumed transfers
+    char name[NAME_SIZE];
+} ControlPacket;
+
+// the receiver's checkpoint, loaded at start and kept up to date by the
+// disk writer
+static Checkpoint resume_point;
+
+// a data packet of either version, as parse_data_packet() finds it
+typedef struct
+{
+    int compressed;
+    unsigned long long seq;     // N in version 1
+    unsigned long long offset;  // version 2 only
+    int header;                 // bytes before the (compressed) data
+    int length;                 // (compressed) data bytes
+    int raw;                    // compressed: length once decompressed
+} DataPacket;
+
+// link layer ARQ profile, must match on both ends
+// (ArqStopAndWait, ArqGoBackN or ArqSelectiveRepeat)
+#define ARQ_MODE ArqSelectiveRepeat
+#define WINDOW_SIZE 16
+#define SEQ_MODULUS 128
+// frame check sequence (FcsBcc, FcsCrc16 or FcsCrc32)
+#define FCS_TYPE FcsCrc32
+// byte stuffing on the wire (FramingHdlc or FramingCobs)
+#define FRAMING FramingCobs
+// Reed-Solomon FEC: most parity bytes per codeword (0 = off) and least
+// number of codewords interleaved in each frame
+#define FEC_MAX_PARITY 16
+#define FEC_INTERLEAVE 4
+// line rate the link steps up to after the handshake when the peer offers
+// it too (0 = stay at the rate main() asks for); it falls back on its own
+// if the line cannot carry it
+#define MAX_BAUDRATE 115200
+// serial port options (SerialLowLatency, SerialRtsCts); RTS/CTS needs the
+// lines wired on both ends
+#define SERIAL_OPTIONS SerialLowLatency
+// application compression codec offered to the peer (COMPRESS_NONE or
+// COMPRESS_LZ) and its level (1 = fastest)
+#define COMPRESSION COMPRESS_LZ
+#define COMPRESSION_LEVEL 1
+// after this many chunks in a row that did not shrink, only every
+// COMPRESS_RETRY_EVERY chunk is tried until one does again
+#define COMPRESS_GIVE_UP 4
+#define COMPRESS_RETRY_EVERY 16
+// threads compressing and decompressing chunks (POOL_PER_CORE = one per
+// core); the link keeps sending while they work on the chunks after it
+#define COMPRESS_WORKERS POOL_PER_CORE
+// when the received file is forced to disk (SyncNever, SyncAtClose or
+// SyncPeriodic, every SYNC_EVERY bytes)
+#define SYNC_POLICY SyncPeriodic
+#define SYNC_EVERY (16 * 1024 * 1024)
+// the transmitter reports how far it got every PROGRESS_EVERY bytes read
+#define PROGRESS_EVERY (16 * 1024 * 1024)
 
 //-----------function definitions------------
-// int data_packet face un packet cu k bytes de informatie din fisier +
-// toate campurile necesare
+// varinturile din packetele v2: 7 biti pe byte, cei mai putin semnificativi
+// primii, bitul 7 setat daca mai urmeaza un byte
+
+// put_varint scrie value in buf si intoarce numarul de bytes
+int put_varint(unsigned char *buf, unsigned long long value) {
+    int n = 0;
+    while (value >= 0x80) {
+        buf[n++] = value | 0x80;
+        value >>= 7;
+    }
+    buf[n++] = value;
+    return n;
+}
+
+// get_varint citeste in *value un varint din cei size bytes ai lui buf si
+// intoarce numarul de bytes, sau -1 daca e trunchiat sau prea lung
+int get_varint(const unsigned char *buf, int size, unsigned long long *value) {
+    *value = 0;
+    for (int n = 0; n < size && n < MAX_VARINT; n++) {
+        *value |= (unsigned long long)(buf[n] & 0x7f) << (7 * n);
+        if ((buf[n] & 0x80) == 0) return n + 1;
+    }
+    return -1;
+}
+
+// int parse_data_packet descrie un packet de date de oricare versiune;
+// intoarce -1 daca e malformat
+int parse_data_packet(const unsigned char *buf, int size, DataPacket *p) {
+    p->raw = 0;
+    if (size < 1) return -1;
+    p->compressed = buf[0] == C_DATA_LZ || buf[0] == C2_DATA_LZ;
+
+    if (buf[0] == C_DATA || buf[0] == C_DATA_LZ) {
+        p->header = buf[0] == C_DATA ? DATA_HEADER_SIZE : DATA_LZ_HEADER_SIZE;
+        if (size < p->header) return -1;
+        p->seq = buf[1];
+        p->offset = 0;
+        p->length = 256 * buf[2] + buf[3];
+        if (p->compressed) p->raw = 256 * buf[4] + buf[5];
+        return p->length <= size - p->header ? 1 : -1;
+    }
+
+    if (buf[0] != C2_DATA && buf[0] != C2_DATA_LZ) return -1;
+    int n = 1;
+    int step = get_varint(buf + n, size - n, &p->seq);
+    if (step < 0) return -1;
+    n += step;
+    step = get_varint(buf + n, size - n, &p->offset);
+    if (step < 0) return -1;
+    n += step;
+    if (p->compressed) {
+        unsigned long long raw;
+        step = get_varint(buf + n, size - n, &raw);
+        if (step < 0 || raw > MAX_PAYLOAD) return -1;
+        n += step;
+        p->raw = raw;
+    }
+    p->header = n;
+    p->length = size - n;
+    return 1;
+}
 
-int data_packet(FILE *file_fd, unsigned char *buf, unsigned char N) {
-    buf[0] = C_DATA;
-    buf[1] = N;
+// int data_packet face un packet cu cel mult k bytes de informatie din
+// fisier + toate campurile necesare, in formatul version; k cuprinde si
+// headerul
+int data_packet(FileSource *file, unsigned char *buf, int version,
+                unsigned long long seq, int k) {
+    if (version == 1) {
+        buf[0] = C_DATA;
+        buf[1] = seq;
+
+        int bytes_read = source_read(file, buf + 4, k - DATA_HEADER_SIZE);
+        buf[2] = bytes_read / 256;
+        buf[3] = bytes_read % 256;
+        // printf("BYTES READ: %d\n", bytes_read);
+        int data_size = bytes_read + 4;
+
+        return data_size;
+    }
 
-    int bytes_read = fread(buf + 4, 1, K, file_fd);
-    buf[2] = bytes_read / 256;
-    buf[3] = bytes_read - buf[2];
-    // printf("BYTES READ: %d\n", bytes_read);
-    int data_size = bytes_read + 4;
+    int n = 0;
+    buf[n++] = C2_DATA;
+    n += put_varint(buf + n, seq);
+    n += put_varint(buf + n, file->offset);
+    return n + source_read(file, buf + n, k - n);
+}
 
-    return data_size;
+// int compressed_packet comprima datele din packetul de date packet in out,
+// in aceeasi versiune; intoarce lungimea packetului comprimat, sau 0 daca
+// nu iese mai mic
+int compressed_packet(LzState *state, const unsigned char *packet,
+                      int data_size, unsigned char *out) {
+    DataPacket p;
+    if (parse_data_packet(packet, data_size, &p) < 0 || p.compressed) return 0;
+
+    int header;
+    if (packet[0] == C_DATA) {
+        header = DATA_LZ_HEADER_SIZE;
+    } else {
+        header = 0;
+        out[header++] = C2_DATA_LZ;
+        header += put_varint(out + header, p.seq);
+        header += put_varint(out + header, p.offset);
+        header += put_varint(out + header, p.length);
+    }
+
+    int capacity = data_size - header - 1;
+    if (capacity <= 0) return 0;
+    int z = lz_compress(state, packet + p.header, p.length, out + header,
+                        capacity, COMPRESSION_LEVEL);
+    if (z == 0) return 0;
+
+    if (packet[0] == C_DATA) {
+        out[0] = C_DATA_LZ;
+        out[1] = packet[1];
+        out[2] = z / 256;
+        out[3] = z % 256;
+        out[4] = p.length / 256;
+        out[5] = p.length % 256;
+    }
+    return z + header;
+}
+
+// compress_job ruleaza pe un worker: comprima packetul de date daca arg e
+// setat; 0 inseamna ca packetul pleaca necomprimat
+int compress_job(void *scratch, const unsigned char *packet, int data_size,
+                 int arg, unsigned char *out) {
+    if (!arg) return 0;
+    return compressed_packet(scratch, packet, data_size, out);
+}
+
+// decompress_job ruleaza pe un worker: decomprima un packet comprimat in
+// out si intoarce lungimea datelor, 0 pentru un packet necomprimat, sau -1
+int decompress_job(void *scratch, const unsigned char *packet, int bytes,
+                   int arg, unsigned char *out) {
+    DataPacket p;
+    if (parse_data_packet(packet, bytes, &p) < 0) return -1;
+    if (!p.compressed) return 0;
+
+    if (p.raw == 0 ||
+        lz_decompress(packet + p.header, p.length, out, MAX_PAYLOAD) != p.raw)
+        return -1;
+    return p.raw;
 }
 
 // int control_packet formeaza un packet de control de tipul START sau STOP, si
-// intoarce lungimea acestui packet
-int control_packet(FILE *file_fd, unsigned char *buf, int c_flag,
-                   const char *pathname) {
+// intoarce lungimea acestui packet; marimea vine din fstat (0 daca nu se
+// cunoaste); un START v2 cu resume > 0 reia transferul de acolo
+int control_packet(const FileSource *file, unsigned char *buf, int c_flag,
+                   const char *pathname, int version, long resume) {
+    if (version != 1) {
+        int n = 0;
+        buf[n++] = c_flag == C_START ? C2_START : C2_END;
+        buf[n++] = T_SIZE;
+        n += put_varint(buf + n, file->size);
+        buf[n++] = T_NAME;
+        buf[n++] = strlen(pathname);
+        memcpy(buf + n, pathname, strlen(pathname));
+        n += strlen(pathname);
+        buf[n++] = T_MTIME;
+        n += put_varint(buf + n, file->mtime);
+        if (c_flag == C_START && resume > 0) {
+            buf[n++] = T_OFFSET;
+            n += put_varint(buf + n, resume);
+        }
+        return n;
+    }
+
     buf[0] = c_flag;
     //-----Size of the file--------
     buf[1] = T_SIZE;
 
-    fseek(file_fd, 0, SEEK_END);
-    long size = ftell(file_fd);
+    long size = file->size;
     long copy_size = size;
-    fseek(file_fd, 0, SEEK_SET);
 
     // calculare L, nr. de digits
     int L = 0;
@@ -73,23 +328,142 @@ int control_packet(FILE *file_fd, unsigned char *buf, int c_flag,
     return 5 + L + strlen(pathname);
 }
 
+// int parse_control_packet citeste un packet START sau END de oricare
+// versiune; intoarce -1 daca e malformat
+int parse_control_packet(const unsigned char *buf, int bytes,
+                         ControlPacket *control) {
+    int n = 2;
+    int v2 = buf[0] == C2_START || buf[0] == C2_END;
+    unsigned long long value;
+    int step;
+    if (bytes < 3 || buf[1] != T_SIZE) return -1;
+    control->mtime = 0;
+    control->offset = 0;
+
+    if (v2) {
+        step = get_varint(buf + n, bytes - n, &value);
+        if (step < 0) return -1;
+        control->size = value;
+        n += step;
+    } else {
+        int length1 = buf[n++];
+        if (n + length1 > bytes) return -1;
+        control->size = 0;
+        for (int i = 0; i < length1; i++) control->size = control->size * 10 + buf[n++] - '0';
+    }
+
+    if (n + 2 > bytes || buf[n] != T_NAME) return -1;
+    int length2 = buf[n + 1];
+    n += 2;
+    if (n + length2 > bytes || length2 + strlen("_received.gif") >= NAME_SIZE)
+        return -1;
+    memcpy(control->name, buf + n, length2);
+    control->name[length2] = '\0';
+    n += length2;
+
+    // version 1 stops at the name
+    while (v2 && n < bytes) {
+        unsigned char type = buf[n++];
+        step = get_varint(buf + n, bytes - n, &value);
+        if (step < 0) return -1;
+        n += step;
+        if (type == T_MTIME) control->mtime = value;
+        if (type == T_OFFSET) control->offset = value;
+    }
+    return 1;
+}
+
+// file_identity intoarce un CRC-32C al numelui, marimii si datei
+// modificarii, dupa care receptorul recunoaste fisierul unui transfer
+// intrerupt
+unsigned int file_identity(const char *name, long size, long mtime) {
+    unsigned char fields[16];
+    for (int i = 0; i < 8; i++) {
+        fields[i] = (unsigned long)size >> (8 * i);
+        fields[8 + i] = (unsigned long)mtime >> (8 * i);
+    }
+    unsigned int crc = fcs_init(FcsCrc32);
+    crc = fcs_update(FcsCrc32, crc, (const unsigned char *)name, strlen(name));
+    return fcs_update(FcsCrc32, crc, fields, sizeof(fields));
+}
+
+// save_checkpoint ruleaza pe threadul care scrie pe disc, dupa fiecare
+// sync; scrie checkpointul intr-un fisier temporar si il redenumeste, ca
+// sa nu ramana niciodata unul pe jumatate
+void save_checkpoint(void *arg, long offset, unsigned int crc) {
+    Checkpoint *checkpoint = arg;
+    checkpoint->offset = offset;
+    checkpoint->crc = crc;
+
+    FILE *f = fopen(RX_CHECKPOINT ".tmp", "wb");
+    if (f == NULL) return;
+    int ok = fwrite(checkpoint, sizeof(Checkpoint), 1, f) == 1;
+    ok = fflush(f) == 0 && fdatasync(fileno(f)) == 0 && ok;
+    if (fclose(f) == 0 && ok) rename(RX_CHECKPOINT ".tmp", RX_CHECKPOINT);
+}
+
+// load_checkpoint citeste checkpointul unui transfer intrerupt si verifica
+// datele deja primite dupa CRC; intoarce -1 daca nu e nimic de reluat
+int load_checkpoint(Checkpoint *checkpoint) {
+    FILE *f = fopen(RX_CHECKPOINT, "rb");
+    if (f == NULL) return -1;
+    int ok = fread(checkpoint, sizeof(Checkpoint), 1, f) == 1;
+    fclose(f);
+    if (!ok || checkpoint->magic != CHECKPOINT_MAGIC || checkpoint->offset <= 0)
+        return -1;
+    checkpoint->name[NAME_SIZE - 1] = '\0';
+
+    char filename[NAME_SIZE + sizeof("_received.gif")];
+    snprintf(filename, sizeof(filename), "%s_received.gif", checkpoint->name);
+    FileSource file;
+    if (source_open(&file, filename) < 0) return -1;
+    unsigned int crc = fcs_init(FcsCrc32);
+    for (long n = 0; file.map != NULL && file.size >= checkpoint->offset &&
+                     n < checkpoint->offset;) {
+        int step = checkpoint->offset - n < (1 << 30) ? checkpoint->offset - n : 1 << 30;
+        crc = fcs_update(FcsCrc32, crc, file.map + n, step);
+        n += step;
+    }
+    source_close(&file);
+    return crc == checkpoint->crc ? 1 : -1;
+}
+
 int sendFile(int connection_fd, const char *pathname, LinkLayer link_struct) {
-    FILE *file_fd = fopen(pathname, "rb");
-    if (file_fd == NULL) {
+    FileSource file;
+    if (source_open(&file, pathname) < 0) {
         perror("The file that you want to send was not opened succesfully\n");
         exit(-1);
     }
     printf("File opened succesfully!\n\n");
 
-    unsigned char buf[BUFSIZE] = {0};
+    static unsigned char buf[MAX_PAYLOAD];
 
-    int control_size = control_packet(file_fd, buf, C_START, pathname);
+    // compress and use the v2 packets only when the receiver agreed to
+    LinkLayer agreed;
+    if (llparameters(connection_fd, &agreed) < 0) {
+        source_close(&file);
+        return -1;
+    }
+    int compress = agreed.compression >= COMPRESS_LZ;
+    int version = agreed.packetVersion >= 2 ? 2 : 1;
+    int incompressible = 0;  // chunks in a row that did not shrink
+
+    // the receiver offered to resume an interrupted transfer of this file
+    long resume = 0;
+    if (version == 2 && agreed.resumeOffset > 0 &&
+        agreed.resumeId == file_identity(pathname, file.size, file.mtime) &&
+        source_seek(&file, agreed.resumeOffset) > 0) {
+        resume = agreed.resumeOffset;
+        printf("Resuming at byte %ld\n\n", resume);
+    }
+
+    int control_size = control_packet(&file, buf, C_START, pathname, version, resume);
     // for (int i = 0; i < control_size; i++) printf("%d ", buf[i]);
 
     //-----------------------------------------
     //-----Trimite primul llwrite()------------
 
-    int ok = llwrite(connection_fd, buf, control_size, link_struct, 0);
+    int ok = llwrite(connection_fd, buf, control_size, link_struct);
     if (ok == 0) {
         perror("Control Packet not sent\n");
         exit(-1);
@@ -98,116 +472,211 @@ int sendFile(int connection_fd, const char *pathname, LinkLayer link_struct) {
 
     //-------------------------------------
 
-    unsigned char N = 0;
-    fseek(file_fd, 0, SEEK_SET);
-    int color = 1;
+    // the packets are read ahead and compressed on the workers, then sent
+    // in order; without compression the pool just hands them back
+    ChunkPool *pool = pool_create(compress ? COMPRESS_WORKERS : 0, MAX_PAYLOAD,
+                                  sizeof(LzState), compress_job);
+    if (pool == NULL) {
+        perror("Compression workers not started\n");
+        source_close(&file);
+        return -1;
+    }
+
+    unsigned long long N = 0;
+    unsigned char *packet;
+    ChunkResult chunk;
+    long progress = file.offset;
     ok = 1;
-    while (!feof(file_fd) && ok != 0) {
-        // unsigned char newbuff[BUFSIZE] = {0};
-        int data_size = data_packet(file_fd, buf, N);
-        ok = llwrite(connection_fd, buf, data_size, link_struct, color % 2);
-        printf("%d bytes of data sent.\nCursor -> %d , FEOF? -> %d\n", ok, ftell(file_fd), feof(file_fd));
-
-        color++;
-        N++;
+    while ((!source_eof(&file) || pool_pending(pool) > 0) && ok != 0) {
+        while (!source_eof(&file) && (packet = pool_input(pool)) != NULL) {
+            // as big a packet as the payload the link layer favours now
+            int k = llpayload(connection_fd);
+            if (k > MAX_PAYLOAD) k = MAX_PAYLOAD;
+            int data_size = data_packet(&file, packet, version, N, k);
+            pool_submit(pool, data_size,
+                        compress && (incompressible < COMPRESS_GIVE_UP ||
+                                     N % COMPRESS_RETRY_EVERY == 0));
+            N++;
+        }
+
+        pool_wait(pool, &chunk);
+        const unsigned char *data = chunk.in;
+        int data_size = chunk.in_size;
+        if (chunk.result > 0) {
+            incompressible = 0;
+            data = chunk.out;
+            data_size = chunk.result;
+        } else
+            incompressible++;
+
+        // the link layer encodes the queued frames ahead; only send when
+        // its queue is full, so the next frames are ready when acks arrive
+        int queued;
+        while ((queued = llprepare(connection_fd, data, data_size)) == 0) {
+            ok = llsend(connection_fd);
+            if (ok <= 0) break;
+        }
+        if (file.offset - progress >= PROGRESS_EVERY) {
+            progress = file.offset;
+            printf("Cursor -> %ld of %ld bytes\n", file.offset, file.size);
+        }
+        if (queued < 0 || ok < 0) ok = 0;
+        pool_release(pool);
     }
-    if ( ok == 0 ) { return -1;}
+    pool_destroy(pool);
 
-    control_size = control_packet(file_fd, buf, C_END, pathname);
-    ok = llwrite(connection_fd, buf, control_size, link_struct, color % 2);
+    if (ok != 0) {
+        control_size = control_packet(&file, buf, C_END, pathname, version, 0);
+        ok = llwrite(connection_fd, buf, control_size, link_struct);
+    }
+    source_close(&file);
     if ( ok == 0 ) { return -1;}
 
     return 1;
 }
 
-int recvFile(int connection_fd) {
-    unsigned char buf[BUFSIZE] = {0};
-    unsigned char filename_start[BUFSIZE] = {0};
-    unsigned char filename_end[BUFSIZE] = {0};
+// int write_chunk da scriitorului de pe disc datele celui mai vechi packet
+// din pool, dupa ce a fost decomprimat
+int write_chunk(ChunkPool *pool, DiskWriter *disk) {
+    ChunkResult chunk;
+    if (pool_wait(pool, &chunk) < 0) return -1;
 
-    FILE *new_fd;
-    int filesize_start = 0;
-    int filesize_end = 0;
+    if (chunk.result < 0) {
+        perror("Compressed data invalid\n");
+        return -1;
+    }
+    if (disk == NULL) return -1;
+    int ok;
+    if (chunk.result > 0)
+        ok = disk_put(disk, chunk.out, chunk.result);
+    else {
+        DataPacket p;
+        parse_data_packet(chunk.in, chunk.in_size, &p);
+        ok = disk_put(disk, chunk.in + p.header, p.length);
+    }
+    pool_release(pool);
+    if (ok < 0) perror("Received file not written\n");
+    return ok;
+}
+
+// data packets are decompressed on the pool's workers and handed in order
+// to the disk writer as slots are needed, and all of them before the END
+// packet is checked; *disk is the received file, closed by the caller on
+// error
+int receive_packets(int connection_fd, ChunkPool *pool, DiskWriter **disk) {
+    char filename[NAME_SIZE + sizeof("_received.gif")];
+    unsigned char *buf;
+
+    ControlPacket start = {0};
+    ControlPacket end;
+    DiskOptions options = {0};
 
-    int counter, L1, L2, k;
-    int color = 0;
+    DataPacket packet;
     int ok_read = 1;
-    int N = -1;
-    unsigned char length1 = 0;
-    unsigned char length2 = 0;
+    unsigned long long N = 0;  // next packet expected
+    unsigned long long received = 0;  // file bytes in the packets so far
 
     //----first llread() is speacial, it contains metainformations about the
     // file
 
     while (ok_read) {
-        int bytes = llread(connection_fd, buf, color % 2);
-        
+        buf = pool_input(pool);
+        if (buf == NULL) {
+            if (write_chunk(pool, *disk) < 0) return -1;
+            continue;
+        }
+        int bytes = llread(connection_fd, buf);
+        if (bytes < 0) return -1;
+
         // for ( int i=0 ; i < bytes; i++)
         // {
         //     printf( "buf[%d]  = %x\n", i , buf[i]);
         // }
         switch (buf[0]) {
             case 0: printf( "SETFRAME sent again\n");
-            case 2:
+            case C_START:
+            case C2_START:
                 printf("START\n");
                 
-                if (buf[1] == T_SIZE) {
-                    length1 = buf[2];
-                    filesize_start = atoi(buf + 3);
-                    printf("filesize=%d bytes\n\n", filesize_start);
-                } else
+                if (parse_control_packet(buf, bytes, &start) < 0)
                     return -1;
-                if (buf[3 + length1] == T_NAME) {
-                    length2 = buf[4 + length1];
-                    strncpy(filename_start, buf + 5 + length1, length2);
-                    filename_start[length2] = '\0';
-                    strcat(filename_start, "_received.gif");
-                    //printf( "length2=%d\nfilename=%s\n", length2 , filename_start);
-
-                    new_fd = fopen(filename_start, "wb");
-                    if(new_fd == NULL)
-                        printf("Could not create a received file!\n");
-                } else
+                printf("filesize=%ld bytes\n\n", start.size);
+                if (*disk != NULL) break;
+
+                // a resumed transfer has to continue the file of the
+                // checkpoint, from where it was saved
+                unsigned int identity =
+                    file_identity(start.name, start.size, start.mtime);
+                if (start.offset > 0 &&
+                    (identity != resume_point.identity ||
+                     start.offset != resume_point.offset ||
+                     strcmp(start.name, resume_point.name) != 0)) {
+                    perror("Resume point invalid\n");
                     return -1;
+                }
+                received = start.offset;
+                options.offset = start.offset;
+                options.crc = resume_point.crc;
+                if (start.offset > 0)
+                    printf("Resuming at byte %ld\n\n", start.offset);
+
+                // only version 2 can resume, so only it is checkpointed
+                resume_point.magic = CHECKPOINT_MAGIC;
+                resume_point.identity = identity;
+                resume_point.size = start.size;
+                strcpy(resume_point.name, start.name);
+                options.size = start.size;
+                options.policy = SYNC_POLICY;
+                options.sync_every = SYNC_EVERY;
+                options.synced = buf[0] == C2_START ? save_checkpoint : NULL;
+                options.arg = &resume_point;
+
+                snprintf(filename, sizeof(filename), "%s_received.gif", start.name);
+                *disk = disk_open(filename, &options);
+                if(*disk == NULL)
+                    printf("Could not create a received file!\n");
 
-                color++;
                 break;
-            case 1:
+            case C_DATA:
+            case C_DATA_LZ:
+            case C2_DATA:
+            case C2_DATA_LZ:
                 printf("INFO\n");
-                counter = buf[1];
-                if (counter != N + 1) {
+                if (parse_data_packet(buf, bytes, &packet) < 0) {
+                    perror("Data packet invalid\n");
+                    return -1;
+                }
+                // version 1 counts modulo 256
+                if (buf[0] == C_DATA || buf[0] == C_DATA_LZ
+                        ? packet.seq != N % 256
+                        : packet.seq != N || packet.offset != received) {
                     perror("Counter invalid\n");
                     return -1;
                 }
                 N++;
-                L1 = buf[2];
-                L2 = buf[3];
-                k = 256 * L1 + L2;
+                received += packet.compressed ? packet.raw : packet.length;
 
-                fwrite(buf + 4 , 1 , k , new_fd);
-                printf( "Cursor -> %d\n\n", ftell(new_fd));
-                color++;
+                pool_submit(pool, bytes, 0);
                 break;
-            case 3:
+            case C_END:
+            case C2_END:
                 printf("END\n\n");
-                if (buf[1] == T_SIZE) {
-                    length1 = buf[2];
-                    filesize_end = atoi(buf + 3);
-                } else
+                while (pool_pending(pool) > 0)
+                    if (write_chunk(pool, *disk) < 0) return -1;
+                if (parse_control_packet(buf, bytes, &end) < 0)
+                    return -1;
+
+                if (strcmp(end.name, start.name) != 0 ||
+                    (start.size != end.size)) {
+                    return -1;
+                }
+                int closed = disk_close(*disk);
+                *disk = NULL;
+                if (closed < 0) {
+                    perror("Received file not written\n");
                     return -1;
-                if (buf[3 + length1] == T_NAME) {
-                    length2 = buf[4 + length1];
-                    strncpy(filename_end, buf + 5 + length1, length2);
-                    filename_end[length2] = '\0';
-                    strcat(filename_end, "_received.gif");
-
-                    if (strcmp(filename_end, filename_start) != 0 ||
-                        (filesize_start != filesize_end)) {
-                        return -1;
-                    }
-                    fclose(new_fd);
                 }
-                color++;
+                unlink(RX_CHECKPOINT);
                 ok_read = 0;
                 break;
 
@@ -220,6 +689,24 @@ int recvFile(int connection_fd) {
     return 1;
 }
 
+int recvFile(int connection_fd) {
+    LinkLayer agreed;
+    if (llparameters(connection_fd, &agreed) < 0) return -1;
+
+    ChunkPool *pool =
+        pool_create(agreed.compression >= COMPRESS_LZ ? COMPRESS_WORKERS : 0,
+                    MAX_PAYLOAD, 0, decompress_job);
+    if (pool == NULL) {
+        perror("Decompression workers not started\n");
+        return -1;
+    }
+    DiskWriter *disk = NULL;
+    int ok = receive_packets(connection_fd, pool, &disk);
+    pool_destroy(pool);
+    if (disk != NULL) disk_close(disk);
+    return ok;
+}
+
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename) {
     /*-----Creare structura LinkLayer si setarea campurilor----*/
@@ -240,6 +727,26 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     link_struct.baudRate = baudRate;
     link_struct.nRetransmissions = nTries;
     link_struct.timeout = timeout;
+    link_struct.arqMode = ARQ_MODE;
+    link_struct.windowSize = WINDOW_SIZE;
+    link_struct.seqModulus = SEQ_MODULUS;
+    link_struct.fcsType = FCS_TYPE;
+    link_struct.framing = FRAMING;
+    link_struct.fecMaxParity = FEC_MAX_PARITY;
+    link_struct.fecInterleave = FEC_INTERLEAVE;
+    link_struct.maxPayload = MAX_PAYLOAD;
+    link_struct.compression = COMPRESSION;
+    link_struct.packetVersion = PACKET_VERSION;
+    link_struct.serialOptions = SERIAL_OPTIONS;
+    link_struct.maxBaudRate = MAX_BAUDRATE;
+    link_struct.resumeOffset = 0;
+    link_struct.resumeId = 0;
+
+    // an interrupted transfer is offered to the transmitter in llopen()
+    if (link_struct.role == LlRx && load_checkpoint(&resume_point) > 0) {
+        link_struct.resumeOffset = resume_point.offset;
+        link_struct.resumeId = resume_point.identity;
+    }
 
     /*------Stabilirea legaturii prin functia llopen()------*/
 
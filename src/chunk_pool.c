@@ -0,0 +1,207 @@
+// Ordered chunk worker pool
+// Chunks sit in a ring of slots: head is the oldest not yet released, next
+// the oldest no worker has taken and tail the next one to fill. Workers
+// take chunks in order but may finish them in any order; pool_wait() hands
+// them back in order, so the ring bounds how far the workers run ahead.
+
+#include "chunk_pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct
+{
+    unsigned char *in;
+    unsigned char *out;
+    int in_size;
+    int arg;
+    int result;
+    int done;
+} ChunkSlot;
+
+struct ChunkPool
+{
+    ChunkJob job;
+    int capacity;
+    int depth;
+    ChunkSlot slot[MAX_POOL_DEPTH];
+    unsigned long head;
+    unsigned long next;
+    unsigned long tail;
+
+    int workers;
+    int started;  // workers that picked their scratch
+    int stop;
+    pthread_t thread[MAX_POOL_WORKERS];
+    void *scratch[MAX_POOL_WORKERS];  // the first one serves inline jobs
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued;    // a chunk is waiting for a worker, or stop
+    pthread_cond_t finished;  // a worker finished a chunk
+};
+
+static inline ChunkSlot *pool_slot(ChunkPool *pool, unsigned long n) {
+    return &pool->slot[n % pool->depth];
+}
+
+static void *worker_main(void *arg) {
+    ChunkPool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    void *scratch = pool->scratch[pool->started++];
+    for (;;) {
+        while (!pool->stop && pool->next == pool->tail)
+            pthread_cond_wait(&pool->queued, &pool->lock);
+        if (pool->stop) break;
+        ChunkSlot *s = pool_slot(pool, pool->next++);
+        pthread_mutex_unlock(&pool->lock);
+
+        int result = pool->job(scratch, s->in, s->in_size, s->arg, s->out);
+
+        pthread_mutex_lock(&pool->lock);
+        s->result = result;
+        s->done = 1;
+        pthread_cond_broadcast(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int online_cores() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores < 1 ? 1 : cores;
+}
+
+////////////////////////////////////////////////
+// POOL_CREATE
+////////////////////////////////////////////////
+ChunkPool *pool_create(int workers, int capacity, int scratch_size,
+                       ChunkJob job) {
+    if (workers == POOL_PER_CORE) workers = online_cores();
+    if (workers < 0) workers = 0;
+    if (workers > MAX_POOL_WORKERS) workers = MAX_POOL_WORKERS;
+
+    ChunkPool *pool = calloc(1, sizeof(ChunkPool));
+    if (pool == NULL) return NULL;
+    pool->job = job;
+    pool->capacity = capacity;
+    // two chunks per worker keep every worker busy while the oldest
+    // results wait to be collected
+    pool->depth = workers == 0 ? 1 : 2 * workers + 2;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    for (int i = 0; i < pool->depth; i++) {
+        pool->slot[i].in = malloc(capacity);
+        pool->slot[i].out = malloc(capacity);
+        if (pool->slot[i].in == NULL || pool->slot[i].out == NULL) {
+            pool_destroy(pool);
+            return NULL;
+        }
+    }
+    int scratches = workers == 0 ? 1 : workers;
+    for (int i = 0; i < scratches; i++) {
+        pool->scratch[i] = calloc(1, scratch_size > 0 ? scratch_size : 1);
+        if (pool->scratch[i] == NULL) {
+            pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    for (; pool->workers < workers; pool->workers++)
+        if (pthread_create(&pool->thread[pool->workers], NULL, worker_main,
+                           pool) != 0)
+            break;
+    if (workers > 0 && pool->workers == 0) {
+        pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+////////////////////////////////////////////////
+// POOL_INPUT
+////////////////////////////////////////////////
+unsigned char *pool_input(ChunkPool *pool) {
+    if (pool->tail - pool->head == pool->depth) return NULL;
+    return pool_slot(pool, pool->tail)->in;
+}
+
+////////////////////////////////////////////////
+// POOL_SUBMIT
+////////////////////////////////////////////////
+void pool_submit(ChunkPool *pool, int size, int arg) {
+    ChunkSlot *s = pool_slot(pool, pool->tail);
+    s->in_size = size;
+    s->arg = arg;
+    s->done = 0;
+
+    if (pool->workers == 0) {
+        s->result = pool->job(pool->scratch[0], s->in, size, arg, s->out);
+        s->done = 1;
+        pool->tail++;
+        pool->next = pool->tail;
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->tail++;
+    pthread_cond_signal(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+////////////////////////////////////////////////
+// POOL_PENDING
+////////////////////////////////////////////////
+int pool_pending(ChunkPool *pool) {
+    return pool->tail - pool->head;
+}
+
+////////////////////////////////////////////////
+// POOL_WAIT
+////////////////////////////////////////////////
+int pool_wait(ChunkPool *pool, ChunkResult *result) {
+    if (pool->head == pool->tail) return -1;
+    ChunkSlot *s = pool_slot(pool, pool->head);
+
+    pthread_mutex_lock(&pool->lock);
+    while (!s->done) pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    result->in = s->in;
+    result->in_size = s->in_size;
+    result->out = s->out;
+    result->result = s->result;
+    return 1;
+}
+
+////////////////////////////////////////////////
+// POOL_RELEASE
+////////////////////////////////////////////////
+void pool_release(ChunkPool *pool) {
+    if (pool->head != pool->tail) pool->head++;
+}
+
+////////////////////////////////////////////////
+// POOL_DESTROY
+////////////////////////////////////////////////
+void pool_destroy(ChunkPool *pool) {
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->workers; i++) pthread_join(pool->thread[i], NULL);
+
+    for (int i = 0; i < MAX_POOL_WORKERS; i++) free(pool->scratch[i]);
+    for (int i = 0; i < pool->depth; i++) {
+        free(pool->slot[i].in);
+        free(pool->slot[i].out);
+    }
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->queued);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
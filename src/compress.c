@@ -0,0 +1,179 @@
+// Chunk compression
+// Greedy LZ77 emitting the LZ4 block format: each sequence is a token
+// (literal length << 4 | match length - 4), the literals, a 2 byte little
+// endian offset and length extensions in 255 steps. Chunks are compressed
+// on their own, so any of them can be decoded without the others.
+
+#include "compress.h"
+
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define LAST_LITERALS 5  // the block always ends in literals
+#define MATCH_LIMIT 12   // no match starts this close to the end
+#define SKIP_TRIGGER 6   // level 1: step grows every 64 bytes without a match
+
+static inline unsigned int read32(const unsigned char *p) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline int hash32(unsigned int v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// writes a length extension (the part past 15) and returns the new op, or
+// -1 when it does not fit
+static int put_length(unsigned char *out, int op, int capacity, int length) {
+    for (; length >= 255; length -= 255) {
+        if (op >= capacity) return -1;
+        out[op++] = 255;
+    }
+    if (op >= capacity) return -1;
+    out[op++] = length;
+    return op;
+}
+
+// literals in[anchor .. anchor + literals) and, when match_length > 0, the
+// match after them
+// return the new op, or -1 when it does not fit
+static int put_sequence(unsigned char *out, int op, int capacity,
+                        const unsigned char *literals, int literal_length,
+                        int offset, int match_length) {
+    if (op >= capacity) return -1;
+    int token = op++;
+    out[token] = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15) {
+        op = put_length(out, op, capacity, literal_length - 15);
+        if (op < 0) return -1;
+    }
+    if (op + literal_length > capacity) return -1;
+    memcpy(out + op, literals, literal_length);
+    op += literal_length;
+    if (match_length == 0) return op;
+
+    if (op + 2 > capacity) return -1;
+    out[op++] = offset & 0xff;
+    out[op++] = offset >> 8;
+    match_length -= MIN_MATCH;
+    out[token] |= match_length < 15 ? match_length : 15;
+    if (match_length >= 15) op = put_length(out, op, capacity, match_length - 15);
+    return op;
+}
+
+int lz_compress(LzState *state, const unsigned char *in, int size,
+                unsigned char *out, int capacity, int level) {
+    if (size > LZ_MAX_INPUT) return 0;
+    memset(state->head, 0xff, sizeof(state->head));  // all -1
+
+    int depth = level <= 1 ? 1 : 4 << level;
+    int match_end = size - LAST_LITERALS;
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+
+    while (ip < size - MATCH_LIMIT) {
+        unsigned int word = read32(in + ip);
+        int h = hash32(word);
+        int candidate = state->head[h];
+        state->chain[ip] = candidate;
+        state->head[h] = ip;
+
+        int best_length = 0;
+        int best_pos = 0;
+        for (int tries = depth; candidate >= 0 && tries > 0 &&
+                                ip - candidate <= MAX_OFFSET;
+             tries--, candidate = state->chain[candidate]) {
+            if (read32(in + candidate) != word) continue;
+            int length = MIN_MATCH;
+            while (ip + length < match_end &&
+                   in[candidate + length] == in[ip + length])
+                length++;
+            if (length > best_length) {
+                best_length = length;
+                best_pos = candidate;
+            }
+        }
+
+        if (best_length == 0) {
+            // level 1 hurries over data that does not compress
+            ip += level <= 1 ? 1 + ((ip - anchor) >> SKIP_TRIGGER) : 1;
+            continue;
+        }
+
+        op = put_sequence(out, op, capacity, in + anchor, ip - anchor,
+                          ip - best_pos, best_length);
+        if (op < 0) return 0;
+
+        // deeper levels index the positions a match covers as well
+        int end = ip + best_length;
+        if (level > 1)
+            for (ip++; ip < end && ip < size - MATCH_LIMIT; ip++) {
+                h = hash32(read32(in + ip));
+                state->chain[ip] = state->head[h];
+                state->head[h] = ip;
+            }
+        ip = end;
+        anchor = ip;
+    }
+
+    op = put_sequence(out, op, capacity, in + anchor, size - anchor, 0, 0);
+    return op < 0 ? 0 : op;
+}
+
+// reads a length extension into *length
+// return the new ip, or -1 past the end of the input
+static int get_length(const unsigned char *in, int ip, int size, int *length) {
+    unsigned char byte;
+    do {
+        if (ip >= size) return -1;
+        byte = in[ip++];
+        *length += byte;
+    } while (byte == 255);
+    return ip;
+}
+
+int lz_decompress(const unsigned char *in, int size, unsigned char *out,
+                  int capacity) {
+    int ip = 0;
+    int op = 0;
+
+    while (ip < size) {
+        unsigned char token = in[ip++];
+
+        int literal_length = token >> 4;
+        if (literal_length == 15) {
+            ip = get_length(in, ip, size, &literal_length);
+            if (ip < 0) return -1;
+        }
+        if (ip + literal_length > size || op + literal_length > capacity)
+            return -1;
+        memcpy(out + op, in + ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if (ip == size) break;  // the last sequence has no match
+
+        if (ip + 2 > size) return -1;
+        int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        int match_length = token & 0x0f;
+        if (match_length == 15) {
+            ip = get_length(in, ip, size, &match_length);
+            if (ip < 0) return -1;
+        }
+        match_length += MIN_MATCH;
+        if (offset == 0 || offset > op || op + match_length > capacity)
+            return -1;
+
+        // the match may overlap what it produces
+        const unsigned char *from = out + op - offset;
+        if (offset >= match_length)
+            memcpy(out + op, from, match_length);
+        else
+            for (int i = 0; i < match_length; i++) out[op + i] = from[i];
+        op += match_length;
+    }
+    return op;
+}
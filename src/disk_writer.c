@@ -0,0 +1,201 @@
+// Asynchronous receive file writer
+// The receiving thread copies data into a single-producer single-consumer
+// ring and moves on; head and tail are atomics, so neither side takes a
+// lock. The writer thread writes the ring out one DISK_BLOCK at a time.
+// DISK_RING is a multiple of DISK_BLOCK, so a block never wraps in the
+// ring and every write but the last is a whole block (aligned in the file
+// unless a resumed transfer started off a block boundary). Semaphores only
+// put a side to sleep: filled is posted when a block fills up, drained
+// when one was written. The writer also keeps the CRC-32C of everything
+// written, which it reports with each sync.
+
+#define _GNU_SOURCE
+#include "disk_writer.h"
+#include "fcs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct DiskWriter
+{
+    int fd;
+    unsigned char *ring;
+    atomic_ulong head;  // bytes queued, advanced by disk_put()
+    atomic_ulong tail;  // bytes written, advanced by the writer thread
+    atomic_int closing;
+    atomic_int failed;
+    sem_t filled;
+    sem_t drained;
+    pthread_t thread;
+
+    long start;  // file offset of ring byte 0
+    unsigned int crc;  // of the file up to start + tail
+    SyncPolicy policy;
+    long sync_every;
+    unsigned long synced;  // bytes covered by the last fdatasync
+    DiskSynced on_synced;
+    void *arg;
+};
+
+// reports what is durable after a successful sync
+static void report_sync(DiskWriter *disk, unsigned long tail) {
+    if (disk->on_synced != NULL && !atomic_load(&disk->failed))
+        disk->on_synced(disk->arg, disk->start + tail, disk->crc);
+}
+
+// pwrite all of buf at offset
+static int write_all(int fd, const unsigned char *buf, long size, long offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, buf, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        size -= n;
+        offset += n;
+    }
+    return 1;
+}
+
+static void *disk_main(void *arg) {
+    DiskWriter *disk = arg;
+    unsigned long tail = atomic_load(&disk->tail);
+
+    for (;;) {
+        // closing first: once it is set, head is final
+        int closing = atomic_load_explicit(&disk->closing, memory_order_acquire);
+        unsigned long head = atomic_load_explicit(&disk->head, memory_order_acquire);
+        unsigned long length = head - tail;
+
+        if (length >= DISK_BLOCK)
+            length = DISK_BLOCK;
+        else if (length == 0 && closing)
+            break;
+        else if (!closing) {
+            sem_wait(&disk->filled);
+            continue;
+        }
+
+        // after a failure the data is dropped, so disk_put() never stalls
+        const unsigned char *block = disk->ring + tail % DISK_RING;
+        if (!atomic_load(&disk->failed) &&
+            write_all(disk->fd, block, length, disk->start + tail) < 0)
+            atomic_store(&disk->failed, 1);
+        disk->crc = fcs_update(FcsCrc32, disk->crc, block, length);
+        tail += length;
+        atomic_store_explicit(&disk->tail, tail, memory_order_release);
+        sem_post(&disk->drained);
+
+        if (disk->policy == SyncPeriodic && tail - disk->synced >= disk->sync_every) {
+            if (fdatasync(disk->fd) < 0) atomic_store(&disk->failed, 1);
+            disk->synced = tail;
+            report_sync(disk, tail);
+        }
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////
+// DISK_OPEN
+////////////////////////////////////////////////
+DiskWriter *disk_open(const char *pathname, const DiskOptions *options) {
+    DiskWriter *disk = calloc(1, sizeof(DiskWriter));
+    if (disk == NULL) return NULL;
+    if (posix_memalign((void **)&disk->ring, DISK_BLOCK, DISK_RING) != 0) {
+        free(disk);
+        return NULL;
+    }
+    disk->fd = open(pathname, O_WRONLY | O_CREAT, 0644);
+    if (disk->fd < 0 || ftruncate(disk->fd, options->offset) < 0) {
+        if (disk->fd >= 0) close(disk->fd);
+        free(disk->ring);
+        free(disk);
+        return NULL;
+    }
+    // reserve the blocks without changing the file size, so a short
+    // transfer leaves no zeroes behind; not every file system can
+    if (options->size > options->offset)
+        fallocate(disk->fd, FALLOC_FL_KEEP_SIZE, options->offset,
+                  options->size - options->offset);
+
+    disk->start = options->offset;
+    disk->crc = options->offset > 0 ? options->crc : fcs_init(FcsCrc32);
+    disk->policy = options->policy;
+    disk->sync_every = options->sync_every > 0 ? options->sync_every : DISK_RING;
+    disk->on_synced = options->synced;
+    disk->arg = options->arg;
+    atomic_init(&disk->head, 0);
+    atomic_init(&disk->tail, 0);
+    atomic_init(&disk->closing, 0);
+    atomic_init(&disk->failed, 0);
+    sem_init(&disk->filled, 0, 0);
+    sem_init(&disk->drained, 0, 0);
+
+    if (pthread_create(&disk->thread, NULL, disk_main, disk) != 0) {
+        close(disk->fd);
+        sem_destroy(&disk->filled);
+        sem_destroy(&disk->drained);
+        free(disk->ring);
+        free(disk);
+        return NULL;
+    }
+    return disk;
+}
+
+////////////////////////////////////////////////
+// DISK_PUT
+////////////////////////////////////////////////
+int disk_put(DiskWriter *disk, const unsigned char *data, int size) {
+    unsigned long head = atomic_load_explicit(&disk->head, memory_order_relaxed);
+
+    while (size > 0) {
+        unsigned long tail = atomic_load_explicit(&disk->tail, memory_order_acquire);
+        unsigned long space = DISK_RING - (head - tail);
+        if (space == 0) {
+            sem_wait(&disk->drained);
+            continue;
+        }
+
+        unsigned long n = DISK_RING - head % DISK_RING;  // up to the wrap
+        if (n > space) n = space;
+        if (n > size) n = size;
+        memcpy(disk->ring + head % DISK_RING, data, n);
+        atomic_store_explicit(&disk->head, head + n, memory_order_release);
+        if ((head + n) / DISK_BLOCK != head / DISK_BLOCK)
+            sem_post(&disk->filled);
+
+        head += n;
+        data += n;
+        size -= n;
+    }
+    return atomic_load(&disk->failed) ? -1 : 1;
+}
+
+////////////////////////////////////////////////
+// DISK_CLOSE
+////////////////////////////////////////////////
+int disk_close(DiskWriter *disk) {
+    atomic_store_explicit(&disk->closing, 1, memory_order_release);
+    sem_post(&disk->filled);
+    pthread_join(disk->thread, NULL);
+
+    int failed = atomic_load(&disk->failed);
+    if (!failed && disk->policy != SyncNever) {
+        if (fsync(disk->fd) < 0)
+            failed = 1;
+        else
+            report_sync(disk, atomic_load(&disk->tail));
+    }
+    if (close(disk->fd) < 0) failed = 1;
+
+    sem_destroy(&disk->filled);
+    sem_destroy(&disk->drained);
+    free(disk->ring);
+    free(disk);
+    return failed ? -1 : 1;
+}
@@ -0,0 +1,136 @@
+// Frame check sequences
+// FcsBcc is the original 1-byte XOR. FcsCrc16 is the HDLC FCS-16 (CRC-16
+// CCITT, reflected, RFC 1662) and FcsCrc32 is CRC-32C (Castagnoli), both
+// table driven 8 bytes per step (slicing-by-8). CRC-32C uses the SSE4.2
+// crc32 instruction when the CPU has it.
+
+#include "fcs.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include "stuffing.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+#define CRC16_POLY 0x8408      // 0x1021 reflected
+#define CRC32C_POLY 0x82F63B78 // 0x1EDC6F41 reflected
+
+static unsigned int crc16_table[8][256];
+static unsigned int crc32c_table[8][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static int have_sse42 = FALSE;
+
+////////////////////////////////////////////////
+// TABLES
+////////////////////////////////////////////////
+// table[k][b]: CRC of byte b followed by k zero bytes
+static void build_table(unsigned int table[8][256], unsigned int poly) {
+    for (int b = 0; b < 256; b++) {
+        unsigned int crc = b;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+        table[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+        for (int b = 0; b < 256; b++)
+            table[k][b] =
+                (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+}
+
+static void init_tables() {
+    build_table(crc16_table, CRC16_POLY);
+    build_table(crc32c_table, CRC32C_POLY);
+#ifdef HAVE_SSE42_CRC
+    __builtin_cpu_init();
+    have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+////////////////////////////////////////////////
+// SLICING-BY-8
+////////////////////////////////////////////////
+// works for any reflected CRC up to 32 bits wide
+static unsigned int crc_slice8(unsigned int table[8][256], unsigned int crc,
+                               const unsigned char *buf, int size) {
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        unsigned int lo = buf[i] | buf[i + 1] << 8 | buf[i + 2] << 16 |
+                          (unsigned int)buf[i + 3] << 24;
+        unsigned int hi = buf[i + 4] | buf[i + 5] << 8 | buf[i + 6] << 16 |
+                          (unsigned int)buf[i + 7] << 24;
+        lo ^= crc;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+    for (; i < size; i++) crc = (crc >> 8) ^ table[0][(crc ^ buf[i]) & 0xff];
+    return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2"))) static unsigned int crc32c_sse42(
+    unsigned int crc, const unsigned char *buf, int size) {
+    unsigned long long crc64 = crc;
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, buf + i, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; i < size; i++) crc = _mm_crc32_u8(crc, buf[i]);
+    return crc;
+}
+#endif
+
+////////////////////////////////////////////////
+// FCS
+////////////////////////////////////////////////
+int fcs_size(LinkFcsType type) {
+    switch (type) {
+        case FcsCrc16:
+            return 2;
+        case FcsCrc32:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+unsigned int fcs_init(LinkFcsType type) {
+    switch (type) {
+        case FcsCrc16:
+            return 0xffff;
+        case FcsCrc32:
+            return 0xffffffff;
+        default:
+            return 0;
+    }
+}
+
+unsigned int fcs_update(LinkFcsType type, unsigned int fcs,
+                        const unsigned char *buf, int size) {
+    pthread_once(&tables_once, init_tables);
+
+    switch (type) {
+        case FcsCrc16:
+            return crc_slice8(crc16_table, fcs, buf, size);
+        case FcsCrc32:
+#ifdef HAVE_SSE42_CRC
+            if (have_sse42) return crc32c_sse42(fcs, buf, size);
+#endif
+            return crc_slice8(crc32c_table, fcs, buf, size);
+        default:
+            return fcs ^ xor_bytes(buf, size);
+    }
+}
+
+void fcs_put(LinkFcsType type, unsigned int fcs, unsigned char *out) {
+    if (type != FcsBcc) fcs = ~fcs;
+    for (int i = 0; i < fcs_size(type); i++) out[i] = fcs >> (8 * i);
+}
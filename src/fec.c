@@ -0,0 +1,211 @@
+// Forward error correction
+// Systematic Reed-Solomon over GF(2^8) (primitive polynomial 0x11d,
+// generator roots alpha^1 .. alpha^parity), shortened to fit each block.
+// Decoding is Berlekamp-Massey, Chien search and Forney.
+
+#include "fec.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define GF_POLY 0x11d
+#define RS_LENGTH 255
+
+static unsigned char gf_exp[2 * RS_LENGTH];
+static unsigned char gf_log[256];
+static unsigned char generator[MAX_FEC_PARITY + 1][MAX_FEC_PARITY + 1];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+////////////////////////////////////////////////
+// GF(2^8)
+////////////////////////////////////////////////
+static inline unsigned char gf_mul(unsigned char a, unsigned char b) {
+    if (a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline unsigned char gf_div(unsigned char a, unsigned char b) {
+    if (a == 0) return 0;
+    return gf_exp[gf_log[a] + RS_LENGTH - gf_log[b]];
+}
+
+// alpha^-power
+static inline unsigned char gf_inv_pow(int power) {
+    return gf_exp[(RS_LENGTH - power % RS_LENGTH) % RS_LENGTH];
+}
+
+static void init_tables() {
+    int x = 1;
+    for (int i = 0; i < RS_LENGTH; i++) {
+        gf_exp[i] = x;
+        gf_exp[i + RS_LENGTH] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= GF_POLY;
+    }
+
+    // generator[p] = (x - alpha^1) .. (x - alpha^p), highest degree first
+    for (int p = 0; p <= MAX_FEC_PARITY; p++) {
+        unsigned char *g = generator[p];
+        memset(g, 0, MAX_FEC_PARITY + 1);
+        g[0] = 1;
+        for (int root = 1; root <= p; root++)
+            for (int j = root; j > 0; j--)
+                g[j] ^= gf_mul(g[j - 1], gf_exp[root]);
+    }
+}
+
+////////////////////////////////////////////////
+// SINGLE CODEWORD
+////////////////////////////////////////////////
+// parity of msg (size bytes) into par (parity bytes)
+static void rs_encode(const unsigned char *msg, int size, unsigned char *par,
+                      int parity) {
+    const unsigned char *g = generator[parity];
+    memset(par, 0, parity);
+    for (int i = 0; i < size; i++) {
+        unsigned char feedback = msg[i] ^ par[0];
+        for (int j = 0; j < parity - 1; j++)
+            par[j] = par[j + 1] ^ gf_mul(feedback, g[j + 1]);
+        par[parity - 1] = gf_mul(feedback, g[parity]);
+    }
+}
+
+// corrects cw (size bytes, parity last) in place
+// return 0, or -1 when there are more errors than parity / 2
+static int rs_decode(unsigned char *cw, int size, int parity) {
+    unsigned char syn[MAX_FEC_PARITY];
+    int clean = 1;
+    for (int k = 0; k < parity; k++) {
+        unsigned char s = 0;
+        for (int i = 0; i < size; i++) s = gf_mul(s, gf_exp[k + 1]) ^ cw[i];
+        syn[k] = s;
+        if (s != 0) clean = 0;
+    }
+    if (clean) return 0;
+
+    // Berlekamp-Massey: error locator lambda, lowest degree first
+    unsigned char lambda[MAX_FEC_PARITY + 1] = {1};
+    unsigned char prev[MAX_FEC_PARITY + 1] = {1};
+    unsigned char tmp[MAX_FEC_PARITY + 1];
+    int errors = 0;
+    int shift = 1;
+    unsigned char prev_delta = 1;
+    for (int n = 0; n < parity; n++) {
+        unsigned char delta = syn[n];
+        for (int i = 1; i <= errors; i++)
+            delta ^= gf_mul(lambda[i], syn[n - i]);
+        if (delta == 0) {
+            shift++;
+            continue;
+        }
+        unsigned char scale = gf_div(delta, prev_delta);
+        memcpy(tmp, lambda, sizeof(tmp));
+        for (int i = 0; i + shift <= parity; i++)
+            lambda[i + shift] ^= gf_mul(scale, prev[i]);
+        if (2 * errors <= n) {
+            errors = n + 1 - errors;
+            memcpy(prev, tmp, sizeof(prev));
+            prev_delta = delta;
+            shift = 1;
+        } else
+            shift++;
+    }
+    if (2 * errors > parity) return -1;
+
+    // error evaluator omega = syn * lambda mod x^parity
+    unsigned char omega[MAX_FEC_PARITY];
+    for (int i = 0; i < parity; i++) {
+        omega[i] = 0;
+        for (int j = 0; j <= i && j <= errors; j++)
+            omega[i] ^= gf_mul(lambda[j], syn[i - j]);
+    }
+
+    // Chien search over the positions actually present, then Forney
+    int found = 0;
+    for (int i = 0; i < size; i++) {
+        unsigned char x_inv = gf_inv_pow(size - 1 - i);
+        unsigned char value = 0;
+        unsigned char power = 1;
+        for (int j = 0; j <= errors; j++) {
+            value ^= gf_mul(lambda[j], power);
+            power = gf_mul(power, x_inv);
+        }
+        if (value != 0) continue;
+
+        unsigned char num = 0, den = 0;
+        power = 1;
+        for (int j = 0; j < parity; j++) {
+            num ^= gf_mul(omega[j], power);
+            // lambda' keeps the odd terms: lambda[j + 1] * x^j for even j
+            if ((j & 1) == 0 && j + 1 <= errors)
+                den ^= gf_mul(lambda[j + 1], power);
+            power = gf_mul(power, x_inv);
+        }
+        if (den == 0) return -1;
+        cw[i] ^= gf_div(num, den);
+        found++;
+    }
+    return found == errors ? 0 : -1;
+}
+
+////////////////////////////////////////////////
+// INTERLEAVED BLOCKS
+////////////////////////////////////////////////
+int fec_codewords(int size, int parity, int interleave) {
+    int n = (size + RS_LENGTH - parity - 1) / (RS_LENGTH - parity);
+    if (n < interleave) n = interleave;
+    if (n > size) n = size;
+    return n > 0 ? n : 1;
+}
+
+int fec_encoded_size(int size, int parity, int interleave) {
+    return size + parity * fec_codewords(size, parity, interleave);
+}
+
+// codeword j holds bytes j, j + n, j + 2n .. of the block, then its parity
+// at size + r * n + j
+int fec_encode(unsigned char *buf, int size, int parity, int interleave) {
+    pthread_once(&tables_once, init_tables);
+    if (parity == 0) return size;
+
+    int n = fec_codewords(size, parity, interleave);
+    unsigned char msg[RS_LENGTH];
+    unsigned char par[MAX_FEC_PARITY];
+    for (int j = 0; j < n; j++) {
+        int len = 0;
+        for (int i = j; i < size; i += n) msg[len++] = buf[i];
+        rs_encode(msg, len, par, parity);
+        for (int r = 0; r < parity; r++) buf[size + r * n + j] = par[r];
+    }
+    return size + parity * n;
+}
+
+int fec_decode(unsigned char *buf, int size, int parity, int interleave) {
+    pthread_once(&tables_once, init_tables);
+    if (parity == 0) return size;
+
+    // the encoded length grows with the block length, so exactly one
+    // codeword count fits
+    int data_size = -1;
+    int n;
+    for (n = 1; parity * n < size; n++) {
+        if (fec_codewords(size - parity * n, parity, interleave) == n) {
+            data_size = size - parity * n;
+            break;
+        }
+    }
+    if (data_size < 0) return -1;
+
+    unsigned char cw[RS_LENGTH];
+    for (int j = 0; j < n; j++) {
+        int len = 0;
+        for (int i = j; i < data_size; i += n) cw[len++] = buf[i];
+        for (int r = 0; r < parity; r++) cw[len++] = buf[data_size + r * n + j];
+        if (rs_decode(cw, len, parity) < 0) return -1;
+
+        len = 0;
+        for (int i = j; i < data_size; i += n) buf[i] = cw[len++];
+    }
+    return data_size;
+}
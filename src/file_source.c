@@ -0,0 +1,89 @@
+// Transmit file source
+// A regular file is mapped once and chunks are copied straight out of the
+// page cache, without stdio's buffering; the kernel is told the access is
+// sequential and asked to fetch SOURCE_READAHEAD bytes ahead of the reader.
+
+#include "file_source.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int source_open(FileSource *src, const char *pathname) {
+    memset(src, 0, sizeof(FileSource));
+
+    int fd = open(pathname, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        src->size = st.st_size;
+        src->mtime = st.st_mtime;
+    }
+    if (src->size > 0) {
+        void *map = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            close(fd);
+            src->map = map;
+            madvise(map, src->size, MADV_SEQUENTIAL);
+            return 1;
+        }
+    }
+
+    // streaming fallback
+    src->file = fdopen(fd, "rb");
+    if (src->file == NULL) {
+        close(fd);
+        return -1;
+    }
+    return 1;
+}
+
+int source_read(FileSource *src, unsigned char *out, int size) {
+    if (src->map == NULL) {
+        int n = fread(out, 1, size, src->file);
+        src->offset += n;
+        src->eof = feof(src->file) || ferror(src->file);
+        return n;
+    }
+
+    if (size > src->size - src->offset) size = src->size - src->offset;
+    // keep the kernel SOURCE_READAHEAD bytes ahead; advised stays page
+    // aligned as it only grows by SOURCE_READAHEAD
+    if (src->advised < src->size &&
+        src->offset + size + SOURCE_READAHEAD / 2 > src->advised) {
+        long length = SOURCE_READAHEAD;
+        if (length > src->size - src->advised) length = src->size - src->advised;
+        madvise((void *)(src->map + src->advised), length, MADV_WILLNEED);
+        src->advised += length;
+    }
+    memcpy(out, src->map + src->offset, size);
+    src->offset += size;
+    src->eof = src->offset == src->size;
+    return size;
+}
+
+int source_seek(FileSource *src, long offset) {
+    if (src->map == NULL || offset < 0 || offset > src->size) return -1;
+    src->offset = offset;
+    // readahead restarts from the SOURCE_READAHEAD boundary below it
+    src->advised = offset - offset % SOURCE_READAHEAD;
+    src->eof = src->offset == src->size;
+    return 1;
+}
+
+int source_eof(const FileSource *src) {
+    return src->eof;
+}
+
+void source_close(FileSource *src) {
+    if (src->map != NULL) munmap((void *)src->map, src->size);
+    if (src->file != NULL) fclose(src->file);
+    memset(src, 0, sizeof(FileSource));
+}
@@ -1,17 +1,22 @@
 // Link layer protocol implementation
 
 #include "link_layer.h"
+#include "fcs.h"
+#include "fec.h"
+#include "stuffing.h"
+#include "transport.h"
 
 // includurile mele
 
+#include <errno.h>
 #include <fcntl.h>
-#include <signal.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 // MISC
@@ -19,22 +24,17 @@
 
 // defineurile mele
 
-#define BAUDRATE B38400
-
 /*----pentru llopen()------*/
-#define F 0x7e
 #define A_SET 0x03
 #define A_UA 0x03  // UA nu e frame de Command, vezi slide 10 din PDF
 #define C_SET 0x03
 #define C_UA 0x07
-#define BUF_SIZE 256
 
 /*------pentru llwrite()----------*/
 
 #define A_WRITE 0x03
 #define C_WHITE 0x00
 #define C_BLACK 0x40
-#define ESC 0x7d
 
 #define A_RR 0x03
 #define C_RR_0 0x05
@@ -48,320 +48,1372 @@
 #define C_DISC 0x0b
 
 #define A_DISC_RX 0x01
-#define SEND_SIZE 512
 
-volatile int STOP = FALSE;
+// SET / UA with this address and a CAP_RATE block ask for and accept a
+// new line rate, see rate_change()
+#define A_RATE 0x05
 
-int alarmCount = 0;
-int alarmEnabled = FALSE;
+/*------------------------- */
 
-void alarmHandler(int signal) {
-    alarmEnabled = FALSE;
-    alarmCount++;
+/*------pentru ferestra Go-Back-N / Selective Repeat----------*/
+
+// Frame types as carried in the low nibble of the control field.
+// In the basic format (modulo 2 and 8) the sequence number lives in the
+// high nibble: N(S) of an I-frame in bits 6,5,4 (bit 6 = LSB, so modulo 2
+// gives C_WHITE/C_BLACK) and N(R) of RR/REJ in bits 7,6,5 (bit 7 = LSB, so
+// modulo 2 gives C_RR_0/C_RR_1). In the extended format (modulo 128) the
+// control byte only holds the type and a separate byte carries the number:
+//   F A C N BCC1 ... with BCC1 = A ^ C ^ N
+#define C_I 0x00
+#define C_RR 0x05
+#define C_REJ 0x01
+#define C_SREJ 0x0d
+#define EXTENDED_MODULUS 128
+
+#define MAX_WINDOW 127
+// CAP_FEC carries the interleave in one byte
+#define MAX_FEC_INTERLEAVE 255
+#define MAX_CONNECTIONS 8
+#define RING_SIZE 4096
+
+// A C [N] BCC1 [FEC] after the opening flag
+#define MAX_HEADER_SIZE 5
+
+// I-frames llprepare() may queue for the encoder thread ahead of llsend()
+#define PREPARE_DEPTH 8
+
+// receive decoder states
+#define DEC_HUNT 0    // waiting for an opening flag
+#define DEC_HEADER 1  // inside A C [N] BCC1 [FEC]
+#define DEC_DATA 2    // data field and FCS, up to the closing flag
+
+// retransmission timeout bounds (ms); the configured timeout is the ceiling
+#define INITIAL_RTO_MS 1000
+#define MIN_RTO_MS 20
+
+// With FEC on, every I-frame header ends in a byte giving the Reed-Solomon
+// parity of its data field as an index into fec_parity[], repeated
+// inverted in the high nibble so a damaged one is never trusted. The
+// transmitter keeps a running loss rate (REJ, SREJ and timeouts against
+// frames acknowledged) and moves one step up or down when it leaves the
+// FEC_LOWER .. FEC_RAISE band, restarting from FEC_SETTLE.
+static const int fec_parity[] = {0, 2, 4, 8, 16, 32};
+#define FEC_LEVELS 6
+#define LOSS_ONE 65536                  // loss rate 1.0
+#define FEC_RAISE (LOSS_ONE * 5 / 100)  // above 5% lost
+#define FEC_LOWER (LOSS_ONE / 100)      // below 1% lost
+#define FEC_SETTLE (LOSS_ONE * 3 / 100)
+
+// The payload llpayload() favours doubles after PAYLOAD_GROW_AFTER frames
+// acknowledged in a row without a loss and halves, at most once per window
+// of frames, when one is lost; it never drops below MIN_ADAPTIVE_PAYLOAD.
+#define PAYLOAD_GROW_AFTER 16
+#define MIN_ADAPTIVE_PAYLOAD 128
+
+// SET and UA may carry a capability block, a list of
+//   type (1 byte) length (1 byte) value (big endian)
+// entries followed by a CRC-16; SET offers the transmitter's profile, UA
+// answers with the profile agreed. Unknown types are skipped, missing ones
+// take the legacy value. U-frames are always HDLC stuffed.
+#define CAPS_SIZE 96
+#define CAPS_FCS FcsCrc16
+#define CAP_MAX_PAYLOAD 0x01  // 2 bytes
+#define CAP_WINDOW 0x02
+#define CAP_MODULUS 0x03
+#define CAP_ARQ 0x04
+#define CAP_FCS 0x05
+#define CAP_FRAMING 0x06
+#define CAP_COMPRESSION 0x07
+#define CAP_FEC 0x08  // 2 bytes: max parity, interleave
+#define CAP_PACKET_VERSION 0x09
+#define CAP_RESUME 0x0a  // 12 bytes: resume id (4), offset (8)
+#define CAP_RATE 0x0b    // 4 bytes: line rate to step up to, in baud
+
+// A stepped up line goes back to the configured rate when its running
+// frame loss rate passes RATE_FALLBACK.
+#define RATE_FALLBACK (LOSS_ONE / 4)
+
+// a legacy receiver buffers 128 bytes of file data and the 4 byte packet
+// header per frame
+#define LEGACY_MAX_PAYLOAD 132
+
+// an I-frame queued by llprepare(): its data and, once encoded, the frame
+// built at the FEC level current when it was queued
+typedef struct {
+    unsigned char* data;  // max_payload bytes
+    int size;
+    int seq;
+    int level;
+    unsigned char* frame;  // frame_capacity() bytes
+    int frame_size;
+    int encoded;
+} PreparedFrame;
+
+typedef struct {
+    int fd;  // transport_fd() of t, -1 when the slot is free
+    Transport* t;
+    LinkLayer params;  // profile in use, agreed with the peer
+    LinkLayer local;   // profile this end offers
+
+    // transmitter: frames ns_base .. ns_next-1 are sent but not acknowledged
+    int ns_base;
+    int ns_next;
+    int max_payload;            // largest data field llwrite() accepts
+    int payload;                // size llpayload() favours
+    int clean_acks;             // frames acknowledged since the last loss
+    unsigned long shrink_until;  // no further shrinking before this acked_total
+    unsigned long acked_total;  // frames acknowledged so far, picks the slots
+    unsigned char* window[MAX_WINDOW];  // stuffed frames, see window_slot()
+    int window_size[MAX_WINDOW];
+    // with FEC, each frame's data and the FEC level it was encoded at, so
+    // a resend can carry more parity than the original
+    unsigned char* window_data[MAX_WINDOW];
+    int window_data_size[MAX_WINDOW];
+    int window_level[MAX_WINDOW];
+    long long sent_at[MAX_WINDOW];  // ms, for RTT samples
+    int resent[MAX_WINDOW];         // no RTT sample from these (Karn)
+    int retries;                    // timeouts in a row without progress
+    int loss;       // running frame loss rate, LOSS_ONE = every frame
+    int fec_level;  // index into fec_parity[] for new I-frames
+    int fec_max_level;
+    unsigned char* fec_buf;  // data field with its FEC, fec_capacity bytes
+    int fec_capacity;
+
+    // transmitter, prepared frames: prep_head .. prep_tail-1 (unwrapped)
+    // are queued; the encoder thread works through them in order, so
+    // llsend() finds the next frame already stuffed and checksummed
+    PreparedFrame prep[PREPARE_DEPTH];
+    unsigned long prep_head;
+    unsigned long prep_tail;
+    unsigned long prep_next;  // oldest the encoder has not taken yet
+    int prep_seq;             // N(S) of the next frame llprepare() queues
+    unsigned char* prep_fec_buf;  // the encoder thread's fec_buf
+    int encoder_running;
+    int encoder_stop;
+    pthread_t encoder;
+    pthread_mutex_t prep_lock;
+    pthread_cond_t prep_queued;   // a frame was queued, or stop
+    pthread_cond_t prep_encoded;  // the encoder finished a frame
+
+    // smoothed round trip time and its mean deviation (RFC 6298), in ms
+    int srtt;
+    int rttvar;
+    int rto;
+
+    // receiver
+    int nr_expected;
+    int rej_sent;  // one REJ per gap, cleared when the gap is filled
+
+    // receiver, Selective Repeat: payloads of frames nr_expected+1 ..
+    // nr_expected+windowSize-1 that arrived before nr_expected
+    unsigned long delivered_total;  // frames handed to llread()'s caller
+    unsigned char* reorder[MAX_WINDOW];
+    int reorder_size[MAX_WINDOW];  // -1 when the slot is empty
+    int srej_sent[MAX_WINDOW];     // one SREJ per missing frame
+
+    // receive path: rx_ring is filled by one read() per burst and drained
+    // by receive_frame(), which destuffs and checks each byte as it comes
+    // out and keeps a partial frame's state between calls
+    unsigned char rx_ring[RING_SIZE];
+    int rx_pos;
+    int rx_len;
+    int dec_state;  // DEC_HUNT, DEC_HEADER or DEC_DATA
+    int dec_escaped;
+    int dec_cobs;  // the frame is COBS encoded (ESC after the opening flag)
+    int dec_cobs_left;  // COBS: run bytes still to come, 0 = code byte next
+    int dec_cobs_flag;  // COBS: an F is implied if another run follows
+    int dec_bad;  // invalid escape or data field too long
+    unsigned char dec_header[MAX_HEADER_SIZE];
+    int dec_header_len;
+    int dec_header_need;
+    unsigned char* dec_dest;  // where data bytes go, NULL = dropped
+    unsigned char* dec_target;  // with FEC, where the repaired data goes
+    int dec_limit;              // room at dec_dest
+    int dec_data_len;
+    // the last fcs_size() bytes seen, the FCS if the frame ends here
+    unsigned char dec_tail[MAX_FCS_SIZE];
+    int dec_tail_len;
+    unsigned int dec_fcs;
+    LinkFcsType dec_fcs_type;
+    unsigned char* rx_packet;  // llread()'s buffer while it waits
+    unsigned char caps[CAPS_SIZE];  // capability block of the last SET / UA
+
+    // last frame decoded; rx_size is -1 when its data field failed the FCS
+    unsigned char rx_address;
+    unsigned char rx_type;
+    int rx_seq;
+    int rx_size;
+    int rx_fec_parity;  // parity per codeword of the I-frame being decoded
+
+    // retransmission timer: receive_frame() gives up at this
+    // CLOCK_MONOTONIC time in ms, 0 means wait forever
+    long long deadline;
+
+    // line rate in use; the receiver goes back to rate_prev if no valid
+    // frame arrives at a new rate before rate_trial_until (0 = settled)
+    int rate;
+    int rate_prev;
+    long long rate_trial_until;
+    int rate_loss;       // transmitter, like loss but kept without FEC
+    int rate_fall_back;  // transmitter: go back to baudRate when idle
+} LinkConnection;
+
+static LinkConnection connections[MAX_CONNECTIONS] = {
+    [0 ... MAX_CONNECTIONS - 1] = {.fd = -1}};
+// connections may be opened and closed from several threads at once
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// data field, FCS and the most FEC parity the connection may add
+int field_capacity(LinkLayer* params, int max_payload) {
+    return fec_encoded_size(max_payload + MAX_FCS_SIZE, params->fecMaxParity,
+                            params->fecInterleave);
+}
 
-    STOP = TRUE;
+// worst case on the wire: with HDLC stuffing every byte after the opening
+// flag escaped, with COBS the marker and one code byte per run
+int frame_capacity(LinkConnection* c, int max_payload) {
+    int body = MAX_HEADER_SIZE + field_capacity(&c->params, max_payload);
+    if (c->params.framing == FramingCobs)
+        return 1 + 1 + body + body / COBS_MAX_RUN + 1 + 1;
+    return 1 + 2 * body + 1;
+}
 
-    printf("Alarm #%d\n", alarmCount);
+void* alloc_or_die(int size) {
+    void* p = malloc(size);
+    if (p == NULL) {
+        perror("malloc");
+        exit(-1);
+    }
+    return p;
+}
+
+LinkConnection* conn_get(int fd) {
+    LinkConnection* c = NULL;
+    pthread_mutex_lock(&connections_lock);
+    for (int i = 0; i < MAX_CONNECTIONS && c == NULL; i++)
+        if (connections[i].fd == fd) c = &connections[i];
+    pthread_mutex_unlock(&connections_lock);
+    return c;
 }
-/*------------------------- */
 
 ////////////////////////////////////////////////
-// SEND RECEIVER_READY
+// LINK PROFILES
 ////////////////////////////////////////////////
-void send_rr(int color, int connection_fd) {
-    unsigned char buf[BUF_SIZE] = {0};
-    buf[0] = F;
-    buf[1] = A_RR;
-    if (color == 0)
-        buf[2] = C_RR_0;
-    else
-        buf[2] = C_RR_1;
-    buf[3] = buf[1] ^ buf[2];
-    buf[4] = F;
+// brings a profile within what this implementation supports
+// return FALSE when it cannot be used
+int profile_normalize(LinkLayer* params) {
+    if (params->arqMode == ArqStopAndWait) {
+        params->windowSize = 1;
+        params->seqModulus = 2;
+    }
+    if (params->seqModulus != 2 && params->seqModulus != 8 &&
+        params->seqModulus != EXTENDED_MODULUS) {
+        printf("Invalid sequence modulus %d\n", params->seqModulus);
+        return FALSE;
+    }
+    // Go-Back-N needs W < modulus so a full window is never ambiguous,
+    // Selective Repeat needs W <= modulus / 2 for the receiver window
+    int max_window = params->seqModulus - 1;
+    if (params->arqMode == ArqSelectiveRepeat)
+        max_window = params->seqModulus / 2;
+    if (params->windowSize < 1) params->windowSize = 1;
+    if (params->windowSize > max_window) params->windowSize = max_window;
+    if (params->windowSize > MAX_WINDOW) params->windowSize = MAX_WINDOW;
+    if (params->fecMaxParity < 0) params->fecMaxParity = 0;
+    if (params->fecMaxParity > MAX_FEC_PARITY)
+        params->fecMaxParity = MAX_FEC_PARITY;
+    if (params->fecInterleave < 1) params->fecInterleave = 1;
+    if (params->fecInterleave > MAX_FEC_INTERLEAVE)
+        params->fecInterleave = MAX_FEC_INTERLEAVE;
+    if (params->maxPayload <= 0) params->maxPayload = MAX_PAYLOAD_SIZE;
+    if (params->maxPayload > MAX_JUMBO_PAYLOAD_SIZE)
+        params->maxPayload = MAX_JUMBO_PAYLOAD_SIZE;
+    if (params->compression < 0) params->compression = 0;
+    if (params->packetVersion < 1) params->packetVersion = 1;
+    if (params->resumeOffset < 0) params->resumeOffset = 0;
+    if (params->baudRate <= 0) params->baudRate = DEFAULT_BAUDRATE;
+    if (params->maxBaudRate < 0) params->maxBaudRate = 0;
+    return TRUE;
+}
 
-    int bytes = write(connection_fd, buf, 5);
+// what a peer that does not negotiate speaks: stop-and-wait, BCC2, HDLC
+LinkLayer legacy_profile(const LinkLayer* local) {
+    LinkLayer params = *local;
+    params.arqMode = ArqStopAndWait;
+    params.windowSize = 1;
+    params.seqModulus = 2;
+    params.fcsType = FcsBcc;
+    params.framing = FramingHdlc;
+    params.fecMaxParity = 0;
+    params.fecInterleave = 1;
+    params.maxPayload = LEGACY_MAX_PAYLOAD;
+    params.compression = 0;
+    params.packetVersion = 1;
+    params.resumeOffset = 0;
+    params.resumeId = 0;
+    params.maxBaudRate = 0;
+    return params;
+}
 
-    if (bytes == -1) {
-        perror("Write error in send_rr()\n");
-        exit(-1);
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// the best profile both ends support: every option is ordered from the
+// most basic up, and each end supports everything below what it offers
+LinkLayer profile_common(const LinkLayer* local, const LinkLayer* peer) {
+    LinkLayer params = *local;
+    params.arqMode = MIN(local->arqMode, peer->arqMode);
+    params.windowSize = MIN(local->windowSize, peer->windowSize);
+    params.seqModulus = MIN(local->seqModulus, peer->seqModulus);
+    params.fcsType = MIN(local->fcsType, peer->fcsType);
+    params.framing = MIN(local->framing, peer->framing);
+    params.fecMaxParity = MIN(local->fecMaxParity, peer->fecMaxParity);
+    params.fecInterleave = MAX(local->fecInterleave, peer->fecInterleave);
+    params.maxPayload = MIN(local->maxPayload, peer->maxPayload);
+    params.compression = MIN(local->compression, peer->compression);
+    params.packetVersion = MIN(local->packetVersion, peer->packetVersion);
+    params.maxBaudRate = MIN(local->maxBaudRate, peer->maxBaudRate);
+    // only the receiver has a resume point to offer
+    if (params.resumeOffset == 0) {
+        params.resumeOffset = peer->resumeOffset;
+        params.resumeId = peer->resumeId;
     }
-    // printf("%d bytes sent by sendrr()\n", bytes);
+    if (!profile_normalize(&params)) params = legacy_profile(local);
+    return params;
 }
 
-////////////////////////////////////////////////
-// SEND REJECTED
-////////////////////////////////////////////////
-void send_rej(int color, int connection_fd) {
-    unsigned char buf[BUF_SIZE] = {0};
-    buf[0] = F;
-    buf[1] = A_REJ;
-    if (color == 0)
-        buf[2] = C_REJ_0;
-    else
-        buf[2] = C_REJ_1;
-    buf[3] = buf[1] ^ buf[2];
-    buf[4] = F;
+// writes params as a capability block and returns its length
+int caps_encode(const LinkLayer* params, unsigned char* out) {
+    int n = 0;
+    out[n++] = CAP_MAX_PAYLOAD;
+    out[n++] = 2;
+    out[n++] = params->maxPayload >> 8;
+    out[n++] = params->maxPayload & 0xff;
+
+    const unsigned char single[][2] = {
+        {CAP_WINDOW, params->windowSize},
+        {CAP_MODULUS, params->seqModulus},
+        {CAP_ARQ, params->arqMode},
+        {CAP_FCS, params->fcsType},
+        {CAP_FRAMING, params->framing},
+        {CAP_COMPRESSION, params->compression},
+        {CAP_PACKET_VERSION, params->packetVersion},
+    };
+    for (int i = 0; i < sizeof(single) / sizeof(single[0]); i++) {
+        out[n++] = single[i][0];
+        out[n++] = 1;
+        out[n++] = single[i][1];
+    }
 
-    int bytes = write(connection_fd, buf, 5);
+    out[n++] = CAP_FEC;
+    out[n++] = 2;
+    out[n++] = params->fecMaxParity;
+    out[n++] = params->fecInterleave;
 
-    if (bytes == -1) {
-        perror("Write error in send_rr()\n");
-        exit(-1);
+    if (params->resumeOffset > 0) {
+        out[n++] = CAP_RESUME;
+        out[n++] = 12;
+        for (int i = 3; i >= 0; i--) out[n++] = params->resumeId >> (8 * i);
+        for (int i = 7; i >= 0; i--) out[n++] = params->resumeOffset >> (8 * i);
+    }
+    if (params->maxBaudRate > 0) {
+        out[n++] = CAP_RATE;
+        out[n++] = 4;
+        for (int i = 3; i >= 0; i--) out[n++] = params->maxBaudRate >> (8 * i);
+    }
+    return n;
+}
+
+// reads a peer's capability block on top of the legacy profile
+LinkLayer caps_decode(const LinkLayer* local, const unsigned char* in,
+                      int size) {
+    LinkLayer params = legacy_profile(local);
+    for (int i = 0; i + 2 <= size && i + 2 + in[i + 1] <= size;
+         i += 2 + in[i + 1]) {
+        const unsigned char* value = in + i + 2;
+        int length = in[i + 1];
+        if (length == 0) continue;
+
+        switch (in[i]) {
+            case CAP_MAX_PAYLOAD:
+                if (length == 2) params.maxPayload = value[0] << 8 | value[1];
+                break;
+            case CAP_WINDOW:
+                params.windowSize = value[0];
+                break;
+            case CAP_MODULUS:
+                params.seqModulus = value[0];
+                break;
+            case CAP_ARQ:
+                if (value[0] <= ArqSelectiveRepeat) params.arqMode = value[0];
+                break;
+            case CAP_FCS:
+                if (value[0] <= FcsCrc32) params.fcsType = value[0];
+                break;
+            case CAP_FRAMING:
+                if (value[0] <= FramingCobs) params.framing = value[0];
+                break;
+            case CAP_COMPRESSION:
+                params.compression = value[0];
+                break;
+            case CAP_PACKET_VERSION:
+                params.packetVersion = value[0];
+                break;
+            case CAP_RESUME:
+                if (length == 12) {
+                    params.resumeId = 0;
+                    params.resumeOffset = 0;
+                    for (int j = 0; j < 4; j++)
+                        params.resumeId = params.resumeId << 8 | value[j];
+                    for (int j = 4; j < 12; j++)
+                        params.resumeOffset = params.resumeOffset << 8 | value[j];
+                }
+                break;
+            case CAP_RATE:
+                if (length == 4)
+                    params.maxBaudRate = value[0] << 24 | value[1] << 16 |
+                                         value[2] << 8 | value[3];
+                break;
+            case CAP_FEC:
+                if (length == 2) {
+                    params.fecMaxParity = value[0];
+                    params.fecInterleave = value[1];
+                }
+                break;
+        }
     }
+    return params;
 }
 
 ////////////////////////////////////////////////
-// STUFFING
+// CONNECTIONS
 ////////////////////////////////////////////////
-int stuffing(unsigned char* buf, int buf_size) {
-    unsigned char stuffed_buf[SEND_SIZE] = {0};
-    stuffed_buf[0] = buf[0];  // primul flag F
+// stops the encoder thread; llprepare() starts it again when needed
+void encoder_stop(LinkConnection* c) {
+    if (!c->encoder_running) return;
+    pthread_mutex_lock(&c->prep_lock);
+    c->encoder_stop = TRUE;
+    pthread_cond_signal(&c->prep_queued);
+    pthread_mutex_unlock(&c->prep_lock);
+    pthread_join(c->encoder, NULL);
+
+    pthread_cond_destroy(&c->prep_encoded);
+    pthread_cond_destroy(&c->prep_queued);
+    pthread_mutex_destroy(&c->prep_lock);
+    c->encoder_running = FALSE;
+    c->prep_head = c->prep_tail = c->prep_next = 0;
+}
 
-    int i = 1;
-    int occ = 0;  // number of 0x7d or 0x7e occurences
+void conn_free_buffers(LinkConnection* c) {
+    encoder_stop(c);
+    for (int i = 0; i < PREPARE_DEPTH; i++) {
+        free(c->prep[i].data);
+        free(c->prep[i].frame);
+        c->prep[i].data = NULL;
+        c->prep[i].frame = NULL;
+    }
+    free(c->prep_fec_buf);
+    c->prep_fec_buf = NULL;
+    for (int i = 0; i < MAX_WINDOW; i++) {
+        free(c->window[i]);
+        free(c->window_data[i]);
+        free(c->reorder[i]);
+        c->window[i] = NULL;
+        c->window_data[i] = NULL;
+        c->reorder[i] = NULL;
+    }
+    free(c->fec_buf);
+    c->fec_buf = NULL;
+}
 
-    while (i < buf_size - 1) {
-        if (buf[i] != F && buf[i] != ESC) {
-            stuffed_buf[i + occ] = buf[i];
-            i++;
-        } else {
-            stuffed_buf[i + occ] = ESC;
-            stuffed_buf[i + occ + 1] = buf[i] ^ 0x20;
-            i++;
-            occ++;
-        }
+// switches the connection to a (normalized) profile and sizes its buffers;
+// only done while no I-frame is in flight
+void conn_apply(LinkConnection* c, LinkLayer params) {
+    conn_free_buffers(c);
+    c->params = params;
+    c->max_payload = params.maxPayload;
+    c->payload = MIN(MAX_PAYLOAD_SIZE, c->max_payload);
+
+    c->fec_level = 0;
+    c->fec_max_level = 0;
+    while (c->fec_max_level + 1 < FEC_LEVELS &&
+           fec_parity[c->fec_max_level + 1] <= params.fecMaxParity)
+        c->fec_max_level++;
+    if (params.fecMaxParity > 0) {
+        c->fec_capacity = field_capacity(&params, c->max_payload);
+        c->fec_buf = alloc_or_die(c->fec_capacity);
     }
 
-    stuffed_buf[i + occ] = buf[i];  // ultimul flag f
+    int capacity = frame_capacity(c, c->max_payload);
+    for (int i = 0; i < params.windowSize; i++) {
+        c->reorder_size[i] = -1;
+        c->srej_sent[i] = FALSE;
+        if (params.role == LlTx) c->window[i] = alloc_or_die(capacity);
+        if (params.role == LlTx && params.fecMaxParity > 0)
+            c->window_data[i] = alloc_or_die(c->max_payload);
+        if (params.role == LlRx && params.arqMode == ArqSelectiveRepeat)
+            c->reorder[i] = alloc_or_die(c->max_payload);
+    }
+}
 
-    buf_size = buf_size + occ;  // actualizare buf_size
+// registers t with the profile it offers; the connection speaks the
+// legacy profile until the handshake agrees on another
+LinkConnection* conn_open(Transport* t, LinkLayer params) {
+    if (!profile_normalize(&params)) return NULL;
+
+    // the slot is claimed before it is set up, outside the lock
+    LinkConnection* c = NULL;
+    pthread_mutex_lock(&connections_lock);
+    for (int i = 0; i < MAX_CONNECTIONS && c == NULL; i++)
+        if (connections[i].fd == -1) c = &connections[i];
+    if (c != NULL) {
+        memset(c, 0, sizeof(*c));
+        c->fd = -2;
+    }
+    pthread_mutex_unlock(&connections_lock);
+    if (c == NULL) {
+        printf("Too many open connections\n");
+        return NULL;
+    }
 
-    memcpy(buf, stuffed_buf, buf_size);
+    c->t = t;
+    c->local = params;
+    c->rate = params.baudRate;
+    c->rto = INITIAL_RTO_MS;
+    if (c->rto > params.timeout * 1000) c->rto = params.timeout * 1000;
+    conn_apply(c, legacy_profile(&params));
+    pthread_mutex_lock(&connections_lock);
+    c->fd = transport_fd(t);
+    pthread_mutex_unlock(&connections_lock);
+    return c;
+}
 
-    return buf_size;
+void conn_release(LinkConnection* c) {
+    conn_free_buffers(c);
+    pthread_mutex_lock(&connections_lock);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    pthread_mutex_unlock(&connections_lock);
 }
+
 ////////////////////////////////////////////////
-// DESTUFFING
+// TIMERS
 ////////////////////////////////////////////////
-int destuffing(unsigned char* buf, int buf_size) {
-    unsigned char destuffed_buf[SEND_SIZE] = {0};
-    destuffed_buf[0] = buf[0];  // primul flag F
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_start(LinkConnection* c, int ms) { c->deadline = now_ms() + ms; }
 
-    int i = 1;
-    int occ = 0;
+void timer_stop(LinkConnection* c) { c->deadline = 0; }
 
-    while (i < buf_size - 1) {
-        if (buf[i] != ESC) {
-            destuffed_buf[i - occ] = buf[i];
-            i++;
-        } else if (buf[i] == ESC) {
-            if (buf[i + 1] == 0x5e)
-                destuffed_buf[i - occ] = F;
-            else if (buf[i + 1] == 0x5d)
-                destuffed_buf[i - occ] = ESC;
-            else
-                return -1;
-            i = i + 2;
-            occ++;
-        } else
-            i++;
+// milliseconds left for poll(), -1 when no timer runs
+int timer_remaining(LinkConnection* c) {
+    if (c->deadline == 0) return -1;
+    long long left = c->deadline - now_ms();
+    return left > 0 ? left : 0;
+}
+
+// feeds one round trip measurement into the estimator and derives the RTO
+void rtt_sample(LinkConnection* c, long long rtt) {
+    if (c->srtt == 0) {
+        c->srtt = rtt > 0 ? rtt : 1;
+        c->rttvar = rtt / 2;
+    } else {
+        long long err = rtt - c->srtt;
+        if (err < 0) err = -err;
+        c->rttvar = (3 * c->rttvar + err) / 4;
+        c->srtt = (7 * c->srtt + rtt) / 8;
     }
 
-    destuffed_buf[i - occ] = buf[i];
-    buf_size = buf_size - occ;
-    memcpy(buf, destuffed_buf, buf_size);
+    c->rto = c->srtt + 4 * c->rttvar;
+    if (c->rto < MIN_RTO_MS) c->rto = MIN_RTO_MS;
+    if (c->rto > c->params.timeout * 1000) c->rto = c->params.timeout * 1000;
+}
+
+// doubles the RTO after a loss, up to the configured timeout
+void rto_backoff(LinkConnection* c) {
+    c->rto *= 2;
+    if (c->rto > c->params.timeout * 1000) c->rto = c->params.timeout * 1000;
+}
+
+int seq_add(LinkConnection* c, int seq, int n) {
+    return (seq + n) % c->params.seqModulus;
+}
+
+// number of steps from "from" forward to "to"
+int seq_dist(LinkConnection* c, int from, int to) {
+    return (to - from + c->params.seqModulus) % c->params.seqModulus;
+}
+
+int window_count(LinkConnection* c) {
+    return seq_dist(c, c->ns_base, c->ns_next);
+}
 
-    return buf_size;
+// the modulus needs not be a multiple of the window size, so slots follow
+// the unwrapped frame count instead of the sequence number
+int window_slot(LinkConnection* c, int seq) {
+    return (c->acked_total + seq_dist(c, c->ns_base, seq)) %
+           c->params.windowSize;
 }
 
 ////////////////////////////////////////////////
-// CHECKING A RECEIVED FRAME, AFTER DESTUFFING
+// FRAME HEADERS
 ////////////////////////////////////////////////
-// return 0 when packet is malformed
-// return 1 when eveerything is ok
-// return 2 when I received a duplicated frame
-// return 3 when I received a SET frame (maybe from an UA lost on the way to TX)
+// writes F A C [N] BCC1 [FEC] and returns the header length
+// an I-frame announces its FEC level when FEC is on
+int build_header(LinkConnection* c, unsigned char* buf, unsigned char type,
+                 int seq, int level) {
+    int n;
+    buf[0] = F;
+    buf[1] = A_WRITE;
+    if (c->params.seqModulus == EXTENDED_MODULUS) {
+        buf[2] = type;
+        buf[3] = seq;
+        buf[4] = buf[1] ^ buf[2] ^ buf[3];
+        n = 5;
+    } else {
+        if (type == C_I)
+            buf[2] = ((seq & 1) << 6) | ((seq >> 1) << 4);
+        else
+            buf[2] = type | ((seq & 1) << 7) | ((seq >> 1) << 5);
+        buf[3] = buf[1] ^ buf[2];
+        n = 4;
+    }
+    if (type == C_I && c->params.fecMaxParity > 0)
+        buf[n++] = level | ((~level & 0x0f) << 4);
+    return n;
+}
 
-int check_received_frame(unsigned char* buf, int bufsize, int expected_color) {
-    // printf( "expect color =%d si bufsize=%d\n", expected_color, bufsize);
+// same as window_slot(), for the receiver's reorder buffer
+int reorder_slot(LinkConnection* c, int seq) {
+    return (c->delivered_total + seq_dist(c, c->nr_expected, seq)) %
+           c->params.windowSize;
+}
+
+// length of A C [N] BCC1 [FEC] for a frame with this control byte
+int header_length(LinkConnection* c, unsigned char ctrl) {
+    if (ctrl == C_SET || ctrl == C_UA || ctrl == C_DISC) return 3;
+
+    int extended = c->params.seqModulus == EXTENDED_MODULUS;
+    int i_frame = extended ? ctrl == C_I : (ctrl & 0x8f) == C_I;
+    int fec = i_frame && c->params.fecMaxParity > 0;
+    return (extended ? 4 : 3) + fec;
+}
+
+// reads an I-frame's FEC byte into rx_fec_parity
+// return FALSE when it is damaged or beyond the configured parity
+int parse_fec_level(LinkConnection* c, unsigned char byte) {
+    int level = byte & 0x0f;
+    if ((byte >> 4) != (~level & 0x0f) || level > c->fec_max_level)
+        return FALSE;
+    c->rx_fec_parity = fec_parity[level];
+    return TRUE;
+}
 
-    if (bufsize == 5) {
-        if (buf[0] == F && buf[1] == A_SET && buf[2] == C_SET &&
-            buf[3] == (buf[1] ^ buf[2]) && buf[4] == F)
-            return 3;
+// parses a destuffed header (A C [N] BCC1 [FEC], without the opening flag)
+// return TRUE, or FALSE when BCC1 fails or the frame is unknown
+// *type is C_I, C_RR, C_REJ, C_SREJ or the whole control byte for U-frames
+int parse_header(LinkConnection* c, const unsigned char* hdr,
+                 unsigned char* type, int* seq) {
+    unsigned char ctrl = hdr[1];
+    int fec = c->params.fecMaxParity > 0;
+    c->rx_fec_parity = 0;
+    if (ctrl == C_SET || ctrl == C_UA || ctrl == C_DISC) {
+        if (hdr[2] != (hdr[0] ^ hdr[1])) return FALSE;
+        *type = ctrl;
+        *seq = 0;
+        return TRUE;
     }
-    if (buf[0] != F) return 0;
-    if (buf[bufsize - 1] != F) return 0;
-    if (buf[1] != A_WRITE) return 0;
-    if (buf[2] != C_BLACK && buf[2] != C_WHITE) return 0;
-    if (buf[2] == C_BLACK && expected_color == 0) return 2;
-    if (buf[2] == C_WHITE && expected_color == 1) return 2;
-    if (buf[3] != (buf[2] ^ buf[1])) {
-        printf("Error at BCC1\n");
-        return 0;
+
+    if (c->params.seqModulus == EXTENDED_MODULUS) {
+        if (hdr[3] != (hdr[0] ^ hdr[1] ^ hdr[2])) return FALSE;
+        if (ctrl != C_I && ctrl != C_RR && ctrl != C_REJ && ctrl != C_SREJ)
+            return FALSE;
+        if (hdr[2] >= EXTENDED_MODULUS) return FALSE;
+        if (ctrl == C_I && fec && !parse_fec_level(c, hdr[4])) return FALSE;
+        *type = ctrl;
+        *seq = hdr[2];
+        return TRUE;
     }
-    // checking if bcc2 is equalto "xor" applied to all characters
-    unsigned char bcc2 = buf[4];
-    for (int i = 5; i < bufsize - 2; i++) {
-        bcc2 = bcc2 ^ buf[i];
+
+    if (hdr[2] != (hdr[0] ^ hdr[1])) return FALSE;
+    if ((ctrl & 0x0f) == C_I && (ctrl & 0x80) == 0) {
+        if (fec && !parse_fec_level(c, hdr[3])) return FALSE;
+        *type = C_I;
+        *seq = ((ctrl >> 6) & 1) | (((ctrl >> 4) & 3) << 1);
+    } else if ((ctrl & 0x1f) == C_RR || (ctrl & 0x1f) == C_REJ ||
+               (ctrl & 0x1f) == C_SREJ) {
+        *type = ctrl & 0x1f;
+        *seq = ((ctrl >> 7) & 1) | (((ctrl >> 5) & 3) << 1);
+    } else
+        return FALSE;
+    return *seq < c->params.seqModulus;
+}
+
+////////////////////////////////////////////////
+// FRAME ENCODER
+////////////////////////////////////////////////
+// the same calls build an HDLC stuffed or a COBS frame; a COBS frame
+// starts with ESC, which no HDLC frame can, so the receiver tells them
+// apart frame by frame
+typedef struct {
+    int cobs;
+    unsigned char* out;
+    int n;
+    CobsEncoder encoder;
+} FrameWriter;
+
+void writer_begin(FrameWriter* w, unsigned char* out, int cobs) {
+    w->cobs = cobs;
+    w->out = out;
+    w->out[0] = F;
+    w->n = 1;
+    if (w->cobs) {
+        w->out[w->n++] = ESC;
+        cobs_begin(&w->encoder, out + w->n);
     }
-    if (bcc2 != buf[bufsize - 2]) {
-        printf("Error at BCC2\n");
-        return 0;
+}
+
+void writer_put(FrameWriter* w, const unsigned char* in, int size) {
+    if (w->cobs)
+        cobs_put(&w->encoder, in, size);
+    else
+        w->n += stuff_bytes(w->out + w->n, in, size);
+}
+
+// closes the frame and returns its length
+int writer_end(FrameWriter* w) {
+    if (w->cobs) w->n = 2 + cobs_end(&w->encoder);
+    w->out[w->n++] = F;
+    return w->n;
+}
+
+// builds a whole frame in a single pass: header, data and FCS are
+// stuffed straight into out (see stuff_bytes() and cobs_put());
+// with FEC the data field and FCS get the parity of the given level in
+// fec_buf (fec_capacity bytes) first
+// only reads the connection's profile, so the encoder thread can use it
+// with its own fec_buf
+// data == NULL gives an RR/REJ/SREJ
+// out must hold frame_capacity(c, size) bytes
+// return the frame length
+int encode_frame_at(LinkConnection* c, unsigned char* out, unsigned char type,
+                    int seq, const unsigned char* data, int size, int level,
+                    unsigned char* fec_buf) {
+    unsigned char header[1 + MAX_HEADER_SIZE];
+    int header_size = build_header(c, header, type, seq, level);
+
+    FrameWriter w;
+    writer_begin(&w, out, c->params.framing == FramingCobs);
+    writer_put(&w, header + 1, header_size - 1);
+
+    if (data != NULL) {
+        LinkFcsType fcs_type = c->params.fcsType;
+        unsigned char fcs[MAX_FCS_SIZE];
+        fcs_put(fcs_type,
+                fcs_update(fcs_type, fcs_init(fcs_type), data, size), fcs);
+
+        int parity = fec_parity[level];
+        if (parity > 0) {
+            memcpy(fec_buf, data, size);
+            memcpy(fec_buf + size, fcs, fcs_size(fcs_type));
+            int field = fec_encode(fec_buf, size + fcs_size(fcs_type), parity,
+                                   c->params.fecInterleave);
+            writer_put(&w, fec_buf, field);
+        } else {
+            writer_put(&w, data, size);
+            writer_put(&w, fcs, fcs_size(fcs_type));
+        }
     }
 
-    return 1;
+    return writer_end(&w);
+}
+
+// encode_frame_at() at the connection's current FEC level
+int encode_frame(LinkConnection* c, unsigned char* out, unsigned char type,
+                 int seq, const unsigned char* data, int size) {
+    return encode_frame_at(c, out, type, seq, data, size, c->fec_level,
+                           c->fec_buf);
 }
+
 ////////////////////////////////////////////////
-// LLOPEN_TRANSMITTER
+// SEND SUPERVISION FRAME
 ////////////////////////////////////////////////
-int llopen_tx(LinkLayer transmitter, int fd) {
-    (void)signal(SIGALRM, alarmHandler);
+void send_supervision(LinkConnection* c, unsigned char type, int nr) {
+    unsigned char buf[frame_capacity(c, 0)];
+    int size = encode_frame(c, buf, type, nr, NULL, 0);
+
+    if (transport_write(c->t, buf, size) < 0) {
+        perror("Write error in send_supervision()\n");
+        exit(-1);
+    }
+}
 
-    while (alarmCount <= transmitter.nRetransmissions) {
-        STOP = FALSE;
+////////////////////////////////////////////////
+// SEND RECEIVER_READY
+////////////////////////////////////////////////
+void send_rr(LinkConnection* c, int nr) { send_supervision(c, C_RR, nr); }
 
-        if (alarmEnabled == FALSE) {
-            unsigned char bcc_set = A_SET ^ C_SET;
-            unsigned char set[5] = {F, A_SET, C_SET, bcc_set, F};
+////////////////////////////////////////////////
+// SEND REJECTED
+////////////////////////////////////////////////
+void send_rej(LinkConnection* c, int nr) { send_supervision(c, C_REJ, nr); }
 
-            int bytes = write(fd, set, 5);
-            if (bytes != 5) {
-                perror("SETFRAME (5 bytes) not sent\n");
-                exit(-1);
-            }
-            alarm(transmitter.timeout);
-            alarmEnabled = TRUE;
+////////////////////////////////////////////////
+// SEND SELECTIVE REJECT
+////////////////////////////////////////////////
+// asks for frame nr only, once until it arrives
+void send_srej(LinkConnection* c, int nr) {
+    int slot = reorder_slot(c, nr);
+    if (c->srej_sent[slot]) return;
+    send_supervision(c, C_SREJ, nr);
+    c->srej_sent[slot] = TRUE;
+}
 
-            // Am trimis set-ul si incep cornometrul si citire de pe teava
-            // alarmHandler-ul imi face STOP = TRUE daca a trecut timeout-ul
+////////////////////////////////////////////////
+// RECEIVE DECODER
+////////////////////////////////////////////////
+// picks where the data field of the frame just parsed is written: an
+// in-sequence I-frame goes straight into llread()'s packet, an early one
+// (Selective Repeat) into its reorder slot
+// a frame carrying FEC is collected whole in fec_buf and only its repaired
+// data is copied there
+void choose_destination(LinkConnection* c) {
+    c->dec_dest = NULL;
+    c->dec_limit = c->max_payload;
+    if (c->rx_type == C_SET || c->rx_type == C_UA) {
+        c->dec_dest = c->caps;
+        c->dec_limit = CAPS_SIZE;
+        return;
+    }
+    if (c->rx_type != C_I || c->params.role != LlRx) return;
+
+    if (c->rx_seq == c->nr_expected) {
+        c->dec_dest = c->rx_packet;
+    } else if (c->params.arqMode == ArqSelectiveRepeat &&
+               seq_dist(c, c->nr_expected, c->rx_seq) < c->params.windowSize) {
+        int slot = reorder_slot(c, c->rx_seq);
+        if (c->reorder_size[slot] < 0) c->dec_dest = c->reorder[slot];
+    }
 
-            unsigned char buf[BUF_SIZE] = {0};
+    if (c->rx_fec_parity > 0) {
+        c->dec_target = c->dec_dest;
+        c->dec_dest = c->fec_buf;
+        c->dec_limit = c->fec_capacity;
+    }
+}
 
-            int i = 0;
-            while (STOP == FALSE) {
-                int bytes = read(fd, buf + i, 1);
-                if (bytes > 1) {
-                    perror("Invalid reading in llopen_tx()!\n");
-                    continue;
-                }
+// closing flag of a frame carrying FEC: repairs fec_buf, then checks the
+// FCS and hands the data on
+void finish_fec_frame(LinkConnection* c) {
+    LinkFcsType fcs_type = c->params.fcsType;
+    int tail_size = fcs_size(fcs_type);
+    c->rx_size = -1;
+    if (c->dec_bad) return;
+
+    int size = fec_decode(c->fec_buf, c->dec_data_len, c->rx_fec_parity,
+                          c->params.fecInterleave);
+    size -= tail_size;
+    if (size < 0 || size > c->max_payload) return;
+
+    unsigned char fcs[MAX_FCS_SIZE];
+    fcs_put(fcs_type,
+            fcs_update(fcs_type, fcs_init(fcs_type), c->fec_buf, size), fcs);
+    if (memcmp(c->fec_buf + size, fcs, tail_size) != 0) return;
+
+    if (c->dec_target != NULL) memcpy(c->dec_target, c->fec_buf, size);
+    c->rx_size = size;
+}
 
-                if (i == 0) {
-                    if (buf[i] == F) {
-                        i++;
-                    }
-                    continue;
-                }
+// TRUE when the data field and FCS just decoded check out
+int field_ok(LinkConnection* c) {
+    int tail_size = fcs_size(c->dec_fcs_type);
+    unsigned char fcs[MAX_FCS_SIZE];
+    fcs_put(c->dec_fcs_type, c->dec_fcs, fcs);
+    return !c->dec_bad && c->dec_tail_len == tail_size &&
+           memcmp(c->dec_tail, fcs, tail_size) == 0;
+}
 
-                if (i == 1) {
-                    if (buf[i] != F) {
-                        i++;
-                    }
-                    continue;
-                }
+// closing flag seen: fills rx_size
+// return TRUE when the frame is to be handed to the caller
+int finish_frame(LinkConnection* c) {
+    int empty = c->dec_data_len == 0 && c->dec_tail_len == 0;
+    if (c->rx_type == C_SET || c->rx_type == C_UA) {
+        // rx_size is the capability block's length, 0 from a legacy peer
+        if (empty) {
+            c->rx_size = 0;
+            return !c->dec_bad;
+        }
+        c->rx_size = c->dec_data_len;
+        return field_ok(c);
+    }
+    if (c->rx_type != C_I) {  // S-frames and DISC carry no data field
+        c->rx_size = 0;
+        return empty && !c->dec_bad;
+    }
+    if (c->rx_fec_parity > 0) {
+        finish_fec_frame(c);
+        return TRUE;
+    }
+    c->rx_size = field_ok(c) ? c->dec_data_len : -1;
+    return TRUE;
+}
 
-                if (i > 1) {
-                    if (buf[i] != F) {
-                        i++;
-                        continue;
-                    } else {
-                        if (i == 4) {
-                            unsigned char bcc_ua = buf[1] ^ buf[2];
-                            if (bcc_ua == buf[3]) {
-                                if (buf[2] != C_UA) {
-                                    i = 0;
-                                    continue;
-                                }
-                                //printf("llopen_tx() succesfull\n");
-                                return 1;
-
-                            } else {
-                                i = 0;
-                                continue;
-                            }
-                        } else {
-                            i = 0;
-                            continue;
-                        }
-                    }
-                }
-            }
-            // for (int j = 0; j < 5; j++) {
-            //     printf("%x\n", buf[j]);
-            // }
+// appends size data bytes to the current frame's data field
+void push_data(LinkConnection* c, const unsigned char* data, int size) {
+    if (c->dec_data_len + size > c->dec_limit) {
+        c->dec_bad = TRUE;
+        c->dec_dest = NULL;
+    } else if (c->dec_dest != NULL)
+        memcpy(c->dec_dest + c->dec_data_len, data, size);
+    c->dec_data_len += size;
+    if (c->rx_fec_parity == 0)
+        c->dec_fcs = fcs_update(c->dec_fcs_type, c->dec_fcs, data, size);
+}
+
+// feeds size already destuffed bytes to the data field; the last
+// fcs_size() bytes are held back as they may turn out to be the FCS
+// (with FEC the FCS is checked only once the block is repaired)
+void decode_run(LinkConnection* c, const unsigned char* run, int size) {
+    if (c->rx_fec_parity > 0) {
+        push_data(c, run, size);
+        return;
+    }
+
+    int tail_size = fcs_size(c->dec_fcs_type);
+    int held = c->dec_tail_len;
+    int flush = held + size - tail_size;
+
+    if (flush <= 0) {
+        memcpy(c->dec_tail + held, run, size);
+        c->dec_tail_len += size;
+        return;
+    }
+
+    int from_tail = flush < held ? flush : held;
+    push_data(c, c->dec_tail, from_tail);
+    push_data(c, run, flush - from_tail);
+
+    unsigned char tail[MAX_FCS_SIZE];
+    int n = 0;
+    for (int i = from_tail; i < held; i++) tail[n++] = c->dec_tail[i];
+    for (int i = flush - from_tail; i < size; i++) tail[n++] = run[i];
+    memcpy(c->dec_tail, tail, n);
+    c->dec_tail_len = n;
+}
+
+// feeds one destuffed byte to the header or the data field
+void decode_plain(LinkConnection* c, unsigned char byte) {
+    if (c->dec_state == DEC_HEADER) {
+        c->dec_header[c->dec_header_len++] = byte;
+        if (c->dec_header_len == 2)
+            c->dec_header_need = header_length(c, byte);
+        if (c->dec_header_len < 2 || c->dec_header_len < c->dec_header_need)
+            return;
+
+        if (c->dec_bad ||
+            !parse_header(c, c->dec_header, &c->rx_type, &c->rx_seq)) {
+            c->dec_state = DEC_HUNT;
+            return;
         }
+        c->rx_address = c->dec_header[0];
+        choose_destination(c);
+        c->dec_state = DEC_DATA;
+        c->dec_data_len = 0;
+        c->dec_tail_len = 0;
+        c->dec_fcs_type = c->rx_type == C_I ? c->params.fcsType : CAPS_FCS;
+        c->dec_fcs = fcs_init(c->dec_fcs_type);
+        return;
     }
 
-    printf("llopen_tx() unsuccesful\n");
-    return 0;
+    if (c->dec_state == DEC_DATA) decode_run(c, &byte, 1);
+}
+
+// destuffs one byte from the wire and feeds it to the current frame
+// return TRUE when it completed a frame
+int decode_byte(LinkConnection* c, unsigned char byte) {
+    if (byte == F) {
+        // a COBS frame cut inside a run lost bytes on the way
+        if (c->dec_cobs_left > 0) c->dec_bad = TRUE;
+        int done = c->dec_state == DEC_DATA && finish_frame(c);
+        // a closing flag may as well open the next frame
+        c->dec_state = DEC_HEADER;
+        c->dec_header_len = 0;
+        c->dec_escaped = FALSE;
+        c->dec_cobs = FALSE;
+        c->dec_cobs_left = 0;
+        c->dec_cobs_flag = FALSE;
+        c->dec_bad = FALSE;
+        return done;
+    }
+    if (c->dec_state == DEC_HUNT) return FALSE;
+
+    if (c->dec_state == DEC_HEADER && c->dec_header_len == 0 &&
+        !c->dec_cobs && !c->dec_escaped && byte == ESC) {
+        c->dec_cobs = TRUE;
+        return FALSE;
+    }
+    if (c->dec_cobs) {
+        if (c->dec_cobs_left > 0) {
+            c->dec_cobs_left--;
+            decode_plain(c, byte);
+            return FALSE;
+        }
+        // code byte: the previous run ended in an F unless it was full
+        int flag = c->dec_cobs_flag;
+        c->dec_cobs_left = cobs_run_length(byte);
+        c->dec_cobs_flag = c->dec_cobs_left < COBS_MAX_RUN;
+        if (flag) decode_plain(c, F);
+        return FALSE;
+    }
+
+    if (c->dec_escaped) {
+        c->dec_escaped = FALSE;
+        if (byte != 0x5e && byte != 0x5d) c->dec_bad = TRUE;
+        byte ^= 0x20;
+    } else if (byte == ESC) {
+        c->dec_escaped = TRUE;
+        return FALSE;
+    }
+
+    decode_plain(c, byte);
+    return FALSE;
+}
+
+// length of the bytes at buf that can go to the data field as they are
+int clean_run(LinkConnection* c, const unsigned char* buf, int size) {
+    if (c->dec_state != DEC_DATA) return 0;
+
+    if (c->dec_cobs) {
+        if (size > c->dec_cobs_left) size = c->dec_cobs_left;
+        const unsigned char* flag = memchr(buf, F, size);
+        return flag != NULL ? flag - buf : size;
+    }
+    return c->dec_escaped ? 0 : find_special(buf, size);
 }
 
 ////////////////////////////////////////////////
-// LLOPEN_RECEIVER
+// LINE RATE
 ////////////////////////////////////////////////
-int llopen_rx(LinkLayer receiver, int fd) {
-    unsigned char buf[BUF_SIZE] = {0};
+// The transmitter steps the rate up after the handshake and back down when
+// frames start getting lost, always with the window empty: it asks for the
+// rate at the old one, the receiver answers and switches, then the
+// transmitter switches and checks the rate with the same request. A
+// receiver that hears nothing valid at the new rate for a trial goes back
+// by itself, so both ends end up at a rate that works.
+
+// how long a receiver waits for a valid frame at a new rate
+int rate_trial_ms(LinkConnection* c) {
+    return (c->params.nRetransmissions + 1) * c->params.timeout * 1000;
+}
 
-    int i = 0;
-    while (STOP == FALSE) {
-        int bytes = read(fd, buf + i, 1);
-        if (bytes > 1) {
-            perror("Invalid reading in  llopen_rx()!\n");
-            continue;
-        }
+int rate_set(LinkConnection* c, int rate) {
+    if (transport_set_rate(c->t, rate) < 0) return -1;
+    c->rate = rate;
+    printf("Line rate %d baud\n", rate);
+    return 1;
+}
+
+// milliseconds left of the receiver's rate trial, -1 when none runs
+int rate_trial_remaining(LinkConnection* c) {
+    if (c->rate_trial_until == 0) return -1;
+    long long left = c->rate_trial_until - now_ms();
+    return left > 0 ? left : 0;
+}
+
+// a frame arrived: a RATE request keeps the trial going (the transmitter is
+// still checking), anything else valid settles the rate
+void rate_heard(LinkConnection* c) {
+    if (c->rate_trial_until == 0) return;
+    if (c->rx_type == C_SET && c->rx_address == A_RATE)
+        c->rate_trial_until = now_ms() + rate_trial_ms(c);
+    else if (c->rx_type != C_I || c->rx_size >= 0)
+        c->rate_trial_until = 0;
+}
+
+// return TRUE when the trial ran out and the rate went back
+int rate_trial_expired(LinkConnection* c) {
+    if (rate_trial_remaining(c) != 0) return FALSE;
+    c->rate_trial_until = 0;
+    printf("Nothing heard at %d baud\n", c->rate);
+    rate_set(c, c->rate_prev);
+    return TRUE;
+}
 
-        if (i == 0) {
-            if (buf[i] == F) {
-                i++;
+////////////////////////////////////////////////
+// RECEIVING A FRAME
+////////////////////////////////////////////////
+// shared by every receive loop
+// with block == TRUE sleeps in poll() until bytes arrive or the
+// connection's timer expires, otherwise only takes what already arrived
+// return TRUE with the frame described by c->rx_*, or FALSE when no
+// complete frame is available in time
+int receive_frame(LinkConnection* c, int block) {
+    while (TRUE) {
+        while (c->rx_pos < c->rx_len) {
+            // inside a data field, bytes up to the next F / ESC (or to the
+            // end of the COBS run) need no destuffing and go in bulk
+            unsigned char* run = c->rx_ring + c->rx_pos;
+            int size = clean_run(c, run, c->rx_len - c->rx_pos);
+            if (size > 0) {
+                decode_run(c, run, size);
+                if (c->dec_cobs) c->dec_cobs_left -= size;
+                c->rx_pos += size;
+                continue;
+            }
+            if (decode_byte(c, c->rx_ring[c->rx_pos++])) {
+                rate_heard(c);
+                return TRUE;
             }
-            continue;
         }
 
-        if (i == 1) {
-            if (buf[i] != F) {
-                i++;
-            }
+        int wait = block ? timer_remaining(c) : 0;
+        if (block && wait == 0) return FALSE;
+        int trial = rate_trial_remaining(c);
+        if (trial >= 0 && (wait < 0 || trial < wait)) wait = trial;
+
+        int ready = transport_wait(c->t, wait);
+        if (ready < 0) {
+            perror("poll");
+            exit(-1);
+        }
+        if (ready == 0) {
+            if (rate_trial_expired(c)) continue;
+            return FALSE;
+        }
+
+        // a peer that is gone answers nothing more, as after a timeout
+        int bytes = transport_read(c->t, c->rx_ring, RING_SIZE);
+        c->rx_pos = 0;
+        c->rx_len = bytes > 0 ? bytes : 0;
+        if (bytes < 0) return FALSE;
+    }
+}
+
+////////////////////////////////////////////////
+// SENDING / RECEIVING U-FRAMES (SET, UA, DISC)
+////////////////////////////////////////////////
+// field (size bytes, may be NULL) is a capability block for SET / UA
+void send_u_frame_field(LinkConnection* c, unsigned char address,
+                        unsigned char control, const unsigned char* field,
+                        int size) {
+    unsigned char header[3] = {address, control, address ^ control};
+    unsigned char frame[1 + 2 * (3 + CAPS_SIZE + MAX_FCS_SIZE) + 1];
+
+    FrameWriter w;
+    writer_begin(&w, frame, FALSE);
+    writer_put(&w, header, 3);
+    if (field != NULL) {
+        unsigned char fcs[MAX_FCS_SIZE];
+        fcs_put(CAPS_FCS,
+                fcs_update(CAPS_FCS, fcs_init(CAPS_FCS), field, size), fcs);
+        writer_put(&w, field, size);
+        writer_put(&w, fcs, fcs_size(CAPS_FCS));
+    }
+    size = writer_end(&w);
+
+    if (transport_write(c->t, frame, size) != size) {
+        perror("U-frame not sent\n");
+        exit(-1);
+    }
+}
+
+void send_u_frame(LinkConnection* c, unsigned char address,
+                  unsigned char control) {
+    send_u_frame_field(c, address, control, NULL, 0);
+}
+
+void print_profile(LinkConnection* c) {
+    const char* arq[] = {"stop-and-wait", "Go-Back-N", "Selective Repeat"};
+    const char* fcs[] = {"BCC2", "CRC-16", "CRC-32C"};
+    LinkLayer* p = &c->params;
+    printf("Link profile: %s, window %d, modulo %d, %s, %s, FEC %d, "
+           "payload %d\n\n",
+           arq[p->arqMode], p->windowSize, p->seqModulus, fcs[p->fcsType],
+           p->framing == FramingCobs ? "COBS" : "HDLC", p->fecMaxParity,
+           p->maxPayload);
+}
+
+// a SET arrived (c->caps holds its capability block, if any): settles the
+// profile and answers with UA, carrying the agreed profile when the
+// transmitter offered one
+void answer_set(LinkConnection* c) {
+    int negotiate = c->rx_size > 0;
+    LinkLayer params = legacy_profile(&c->local);
+    if (negotiate) {
+        LinkLayer offer = caps_decode(&c->local, c->caps, c->rx_size);
+        params = profile_common(&c->local, &offer);
+    }
+    // a repeated SET means our UA got lost, nothing was sent yet
+    if (c->delivered_total == 0) conn_apply(c, params);
+
+    if (negotiate) {
+        unsigned char caps[CAPS_SIZE];
+        int size = caps_encode(&c->params, caps);
+        send_u_frame_field(c, A_UA, C_UA, caps, size);
+    } else
+        send_u_frame(c, A_UA, C_UA);
+}
+
+// waits for the next valid SET, UA or DISC
+// I-frames still arriving at the receiver are retransmissions whose RR got
+// lost, so they are acknowledged again
+// return 1 with the frame's address/control, or 0 on timeout
+int receive_u_frame(LinkConnection* c, unsigned char* address,
+                    unsigned char* control) {
+    while (receive_frame(c, TRUE)) {
+        unsigned char type = c->rx_type;
+
+        if (type == C_I && c->params.role == LlRx) {
+            if (c->rx_seq != c->nr_expected) send_rr(c, c->nr_expected);
             continue;
         }
+        if (type != C_SET && type != C_UA && type != C_DISC) continue;
 
-        if (i > 1) {
-            if (buf[i] != F) {
-                i++;
-                continue;
-            } else {
-                if (i == 4) {
-                    unsigned char bcc_set = buf[1] ^ buf[2];
-                    if (bcc_set == buf[3]) {
-                        if (buf[2] != C_SET) {
-                            i = 0;
-                            continue;
-                        }
-                        STOP = TRUE;
-                        // la momentul acesta stiu ca am primit un SET corect,
-                        // deci trimit UA si returnez 1
-
-                        // trimitere UA
-                        unsigned char bcc_ua = A_UA ^ C_UA;
-                        unsigned char ua[5] = {F, A_UA, C_UA, bcc_ua, F};
-
-                        int bytes = write(fd, ua, 5);
-                        if (bytes != 5) {
-                            perror(
-                                "UAFRAME (5 bytes) not sent in "
-                                "llopen_rx()\n");
-                            exit(-1);
-                        }
-                        return 1;
-                    } else {
-                        i = 0;
-                        continue;
-                    }
-                } else {
-                    i = 0;
-                    continue;
-                }
+        *address = c->rx_address;
+        *control = type;
+        return 1;
+    }
+    return 0;
+}
+
+// the CAP_RATE block of a RATE request or answer
+int rate_field(int rate, unsigned char* out) {
+    out[0] = CAP_RATE;
+    out[1] = 4;
+    for (int i = 3; i >= 0; i--) out[5 - i] = rate >> (8 * i);
+    return 6;
+}
+
+// receiver: agrees to a RATE request for the configured rate or one up to
+// the agreed step-up rate, then switches
+void answer_rate(LinkConnection* c) {
+    int rate = caps_decode(&c->local, c->caps, c->rx_size).maxBaudRate;
+    if (rate != c->params.baudRate &&
+        (rate <= 0 || rate > c->params.maxBaudRate))
+        return;
+
+    unsigned char field[6];
+    send_u_frame_field(c, A_RATE, C_UA, field, rate_field(rate, field));
+    if (rate == c->rate) return;
+    int prev = c->rate;
+    if (rate_set(c, rate) < 0) return;
+    c->rate_prev = prev;
+    c->rate_trial_until = now_ms() + rate_trial_ms(c);
+}
+
+// transmitter: sends a RATE request every RTO until it is answered
+// return 1, or 0 when nothing came back before until
+int rate_request(LinkConnection* c, int rate, long long until) {
+    unsigned char field[6];
+    int size = rate_field(rate, field);
+    unsigned char address, control;
+
+    while (now_ms() < until) {
+        send_u_frame_field(c, A_RATE, C_SET, field, size);
+        timer_start(c, c->rto);
+        while (receive_u_frame(c, &address, &control)) {
+            if (address == A_RATE && control == C_UA && c->rx_size > 0 &&
+                caps_decode(&c->local, c->caps, c->rx_size).maxBaudRate == rate) {
+                timer_stop(c);
+                return 1;
             }
         }
+        rto_backoff(c);
+    }
+    timer_stop(c);
+    return 0;
+}
+
+// transmitter, with the window empty: moves both ends to rate, or leaves
+// them at the current one when the new rate does not work
+// return 1, or 0 when the receiver stopped answering
+int rate_change(LinkConnection* c, int rate) {
+    int prev = c->rate;
+    // the receiver may have switched while its answer got lost, so the
+    // request is repeated until it gave up on the trial
+    if (!rate_request(c, rate, now_ms() + 2 * rate_trial_ms(c))) return 0;
+    if (rate == prev) return 1;
+
+    if (rate_set(c, rate) > 0 &&
+        rate_request(c, rate, now_ms() + rate_trial_ms(c) / 2))
+        return 1;
+
+    // the receiver goes back too once the trial is over
+    printf("Line rate %d baud does not work\n", rate);
+    rate_set(c, prev);
+    return rate_request(c, prev, now_ms() + 2 * rate_trial_ms(c));
+}
+
+////////////////////////////////////////////////
+// LLOPEN_TRANSMITTER
+////////////////////////////////////////////////
+// the first half of the tries offer our profile; a legacy receiver ignores
+// a SET with a capability block, so the rest are plain SETs
+int llopen_tx(LinkLayer transmitter, int fd) {
+    LinkConnection* c = conn_get(fd);
+    int offer_tries = (transmitter.nRetransmissions + 2) / 2;
+    unsigned char caps[CAPS_SIZE];
+    int caps_size = caps_encode(&c->local, caps);
+
+    for (int tries = 0; tries <= transmitter.nRetransmissions; tries++) {
+        int offer = tries < offer_tries;
+        if (offer)
+            send_u_frame_field(c, A_SET, C_SET, caps, caps_size);
+        else
+            send_u_frame(c, A_SET, C_SET);
+        long long sent_at = now_ms();
+
+        // Am trimis set-ul si incep cornometrul si citire de pe teava
+        // receive_u_frame() intoarce 0 daca a trecut timeout-ul
+        timer_start(c, c->rto);
+
+        unsigned char address, control;
+        while (receive_u_frame(c, &address, &control)) {
+            if (address != A_UA || control != C_UA) continue;
+            // once a plain SET went out the receiver settles on legacy
+            if (c->rx_size > 0 && !offer) continue;
+
+            timer_stop(c);
+            if (tries == 0) rtt_sample(c, now_ms() - sent_at);
+            if (c->rx_size > 0) {
+                LinkLayer agreed = caps_decode(&c->local, c->caps, c->rx_size);
+                conn_apply(c, profile_common(&c->local, &agreed));
+            } else
+                conn_apply(c, legacy_profile(&c->local));
+            print_profile(c);
+            // a failed step up leaves the line at the configured rate
+            if (c->params.maxBaudRate > c->rate)
+                rate_change(c, c->params.maxBaudRate);
+            return 1;
+        }
+        rto_backoff(c);
+    }
+
+    timer_stop(c);
+    printf("llopen_tx() unsuccesful\n");
+    return 0;
+}
+
+////////////////////////////////////////////////
+// LLOPEN_RECEIVER
+////////////////////////////////////////////////
+int llopen_rx(LinkLayer receiver, int fd) {
+    LinkConnection* c = conn_get(fd);
+    unsigned char address, control;
+
+    timer_stop(c);
+    while (receive_u_frame(c, &address, &control)) {
+        if (address == A_SET && control == C_SET) {
+            // la momentul acesta stiu ca am primit un SET corect,
+            // deci trimit UA si returnez 1
+            answer_set(c);
+            print_profile(c);
+            return 1;
+        }
     }
 
     printf("llopen_rx() failed\n");
@@ -374,46 +1426,26 @@ int llopen_rx(LinkLayer receiver, int fd) {
 int llopen(LinkLayer connectionParameters) {
     // TODO
 
-    int fd = open(connectionParameters.serialPort, O_RDWR | O_NOCTTY);
+    // a serial port, or one end of an in-process pair (transport.h): the
+    // transmitter takes end 0 and the receiver end 1
+    int options = connectionParameters.serialOptions;
+    Transport* t = transport_open(
+        connectionParameters.serialPort, connectionParameters.role == LlRx,
+        connectionParameters.baudRate,
+        (options & SerialLowLatency ? TRANSPORT_LOW_LATENCY : 0) |
+            (options & SerialRtsCts ? TRANSPORT_RTS_CTS : 0));
 
-    if (fd < 0) {
+    if (t == NULL) {
         perror("Connection FD could not be opened!\n");
         exit(-1);
     }
+    int fd = transport_fd(t);
 
-    /*-----Setarea argumentelor pentru controlul portului serial------*/
-
-    struct termios oldtio;
-    struct termios newtio;
-    // Save current port settings
-    if (tcgetattr(fd, &oldtio) == -1) {
-        perror("tcgetattr");
-        exit(-1);
-    }
-    // Clear struct for new port settings
-    memset(&newtio, 0, sizeof(newtio));
-    newtio.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio.c_iflag = IGNPAR;
-    newtio.c_oflag = 0;
-    // Set input mode (non-canonical, no echo,...)
-    newtio.c_lflag = 0;
-    newtio.c_cc[VTIME] = 1;  // Inter-character timer used
-    newtio.c_cc[VMIN] = 0;   // Non-Blocking read
-    // VTIME e VMIN should be changed in order to protect with a
-    // timeout the reception of the following character(s)
-    // Now clean the line and activate the settings for the port
-    // tcflush() discards data written to the object referred to
-    // by fd but not transmitted, or data received but not read,
-    // depending on the value of queue_selector:
-    //   TCIFLUSH - flushes data received but not read.
-    tcflush(fd, TCIOFLUSH);
-    // Set new port settings
-    if (tcsetattr(fd, TCSANOW, &newtio) == -1) {
-        perror("tcsetattr");
-        exit(-1);
+    LinkConnection* c = conn_open(t, connectionParameters);
+    if (c == NULL) {
+        transport_close(t);
+        return -1;
     }
-    printf("New termios structure set\n");
-    /*----------------------------------------------------------------*/
 
     if (connectionParameters.role == LlRx) {
         if (llopen_rx(connectionParameters, fd) > 0) {
@@ -430,478 +1462,571 @@ int llopen(LinkLayer connectionParameters) {
         exit(-1);
     }
 
+    conn_release(c);
+    transport_close(t);
     return -1;
 }
 
 ////////////////////////////////////////////////
-// LLWRITE
+// ADAPTATION TO THE LINE
 ////////////////////////////////////////////////
-int llwrite(int connection_fd, const unsigned char* buf, int bufSize,
-            LinkLayer link_struct, int color) {
-    unsigned char final_buf[SEND_SIZE] = {0};
-    final_buf[0] = F;
-    final_buf[1] = A_WRITE;
-    if (color == 0) final_buf[2] = C_WHITE;
-    if (color == 1) final_buf[2] = C_BLACK;
-    final_buf[3] = final_buf[1] ^ final_buf[2];  // BCC1
-
-    unsigned char bcc2 = buf[0];
-    final_buf[4] = buf[0];
-
-    int i = 1;
-    for (i = 1; i < bufSize; i++) {
-        final_buf[i + 4] = buf[i];
-        bcc2 = bcc2 ^ buf[i];
-    }
-    final_buf[i + 4] = bcc2;
-    final_buf[i + 5] = F;
-    int final_bufSize = bufSize + 6;
-
-    int new_final_bufSize = stuffing(final_buf, final_bufSize);
-
-    //-----implementation of TIMEOUT and RETRANSIMISSION --------
-
-    alarmCount = 0;
-    STOP = FALSE;
-    alarmEnabled = FALSE;
-    (void)signal(SIGALRM, alarmHandler);
-
-resend_frame:
-
-    while (alarmCount <= link_struct.nRetransmissions) {
-        if (alarmEnabled == FALSE) {
-            int bytes = write(connection_fd, final_buf, new_final_bufSize);
-
-            // printf("Trimit : ");
-            // for (int i = 0; i < new_final_bufSize; i++) {
-            //     printf("%x ", final_buf[i]);
-            // }
-            // printf("\n");
-
-            if (bytes == -1) {
-                perror("Write error in llwrite()\n");
-                exit(-1);
-            }
+// feeds one frame's fate into the loss rate and picks the FEC parity for
+// the frames still to be encoded
+void fec_adapt(LinkConnection* c, int lost) {
+    if (c->params.fecMaxParity == 0) return;
+
+    if (lost)
+        c->loss += (LOSS_ONE - c->loss) >> 4;
+    else
+        c->loss -= c->loss >> 4;
+
+    if (c->loss > FEC_RAISE && c->fec_level < c->fec_max_level) {
+        c->fec_level++;
+        c->loss = FEC_SETTLE;
+    } else if (c->loss < FEC_LOWER && c->fec_level > 0) {
+        c->fec_level--;
+        c->loss = FEC_SETTLE;
+    }
+}
 
-            printf("Frame sent!\n");
-            alarm(link_struct.timeout);
-            alarmEnabled = TRUE;
-            STOP = FALSE;
+// grows or shrinks the payload llpayload() favours
+void payload_adapt(LinkConnection* c, int lost) {
+    if (!lost) {
+        if (++c->clean_acks < PAYLOAD_GROW_AFTER) return;
+        c->clean_acks = 0;
+        c->payload *= 2;
+        if (c->payload > c->max_payload) c->payload = c->max_payload;
+        return;
+    }
 
-            // Am trimis data_frame-ul si astept RR sau REJ
+    c->clean_acks = 0;
+    // frames already in flight were cut at the old size
+    if (c->acked_total < c->shrink_until) return;
+    c->shrink_until = c->acked_total + window_count(c);
+    c->payload /= 2;
+    if (c->payload < MIN_ADAPTIVE_PAYLOAD) c->payload = MIN_ADAPTIVE_PAYLOAD;
+    if (c->payload > c->max_payload) c->payload = c->max_payload;
+}
 
-            unsigned char recv_buf[512] = {0};
-            int i = 0;
+// marks a stepped up line that loses too many frames to go back to the
+// configured rate
+void rate_adapt(LinkConnection* c, int lost) {
+    if (c->rate == c->params.baudRate) return;
 
-            while (STOP == FALSE) {
-                int bytes_read = read(connection_fd, recv_buf + i, 1);
-                if (bytes_read > 1) {
-                    perror("Incorrect read() in llwrite()\n");
-                    exit(-1);
-                }
-                // printf("buf[i] = %x si i=%d\n", recv_buf[i], i);
-
-                switch (i) {
-                    case 0:
-                        if (recv_buf[i] == F) {
-                            i++;
-                            continue;
-                        } else {
-                            continue;
-                        }
-                        break;
-
-                    case 1:
-                        if (recv_buf[i] == F) {
-                            continue;
-                        } else {
-                            i++;
-                            continue;
-                        }
-                        break;
-
-                    default:
-                        if (recv_buf[i] != F) {
-                            i++;
-                            continue;
-                        } else {
-                            if (i == 4) {
-                                unsigned char bcc1 = recv_buf[1] ^ recv_buf[2];
-                                if (bcc1 == recv_buf[3]) {
-                                    if ((recv_buf[2] == C_REJ_0 &&
-                                         color == 0) ||
-                                        (recv_buf[2] == C_REJ_1 &&
-                                         color == 1)) {
-                                        // trebuie sa facem resend!
-                                        tcflush(connection_fd, TCIOFLUSH);
-                                        printf(
-                                            "Received REJ. Need to resend "
-                                            "frame!\n\n");
-                                        goto resend_frame;
-                                    }
-                                    if ((recv_buf[2] == C_RR_1 && color == 0) ||
-                                        (recv_buf[2] == C_RR_0 && color == 1)) {
-                                        // totul bine!
-                                        printf(
-                                            "Frame acknowledged succesfully!\n\n");
-                                        return bytes;
-                                    }
-                                    i = 0;
-                                    continue;
-                                } else {
-                                    i = 0;
-                                    continue;
-                                }
-                            } else {
-                                i = 0;
-                                continue;
-                            }
-                        }
-                        break;
-                }
-            }
-        }
-    }
-    printf("Did not receive REJ or RR\n\n");
-    return 0;
+    if (lost)
+        c->rate_loss += (LOSS_ONE - c->rate_loss) >> 4;
+    else
+        c->rate_loss -= c->rate_loss >> 4;
+    if (c->rate_loss > RATE_FALLBACK) c->rate_fall_back = TRUE;
+}
+
+// a frame was acknowledged (lost == FALSE) or had to be sent again
+void frame_outcome(LinkConnection* c, int lost) {
+    fec_adapt(c, lost);
+    payload_adapt(c, lost);
+    rate_adapt(c, lost);
 }
 
 ////////////////////////////////////////////////
-// LLREAD
+// RESEND OUTSTANDING FRAMES
 ////////////////////////////////////////////////
-int llread(int connection_fd, unsigned char* packet, int expected_color) {
-    // receiving the stuffed frame byte by byte
+// the frame goes out again with more FEC if the line got worse meanwhile
+void resend_frame(LinkConnection* c, int seq) {
+    int slot = window_slot(c, seq);
+    if (c->window_data[slot] != NULL && c->window_level[slot] < c->fec_level) {
+        c->window_size[slot] =
+            encode_frame(c, c->window[slot], C_I, seq, c->window_data[slot],
+                         c->window_data_size[slot]);
+        c->window_level[slot] = c->fec_level;
+    }
+    if (transport_write(c->t, c->window[slot], c->window_size[slot]) < 0) {
+        perror("Write error in resend_frame()\n");
+        exit(-1);
+    }
+    c->sent_at[slot] = now_ms();
+    c->resent[slot] = TRUE;
+}
 
-    unsigned char buf[BUF_SIZE] = {0};
-    int i = 0;
-waiting:
-    i = 0;
+// Go-Back-N: seq and everything sent after it
+void resend_from(LinkConnection* c, int seq) {
+    for (; seq != c->ns_next; seq = seq_add(c, seq, 1)) resend_frame(c, seq);
+}
 
-    STOP = FALSE;
-    while (STOP == FALSE) {
-        int bytes = read(connection_fd, buf + i, 1);
-        if (bytes > 1) {
-            perror("Invalid read in llread()\n");
-            exit(-1);
-        }
-        // printf("buf[i] = %x si i=%d\n", buf[i], i );
-        //  receiving the 1st flag
-        switch (i) {
-            case 0:
-                if (buf[i] != F)
-                    continue;
-                else {
-                    i++;
-                    continue;
-                }
-                break;
-            case 1:
-                if (buf[i] == A_WRITE) {
-                    i++;
-                    continue;
-                }
-                if (buf[i] == F) {
-                    continue;
-                }
-                i = 0;
-                continue;
-                break;
-            default:
-                if (buf[i] == F) {
-                    STOP = TRUE;
-                    continue;
-                }
-                i++;
-                continue;
-                break;
-        }
+// the retransmission timer expired: back off and resend
+// return 1, or 0 when the peer stopped answering
+int retransmit_on_timeout(LinkConnection* c) {
+    if (++c->retries > c->params.nRetransmissions) {
+        printf("Did not receive REJ or RR\n\n");
+        return 0;
     }
+    rto_backoff(c);
+    frame_outcome(c, TRUE);
 
-    // destuffing the received frame
-    int buf_size = i + 1;
-    int new_buf_size = destuffing(buf, buf_size);
-    int flag = check_received_frame(buf, new_buf_size, expected_color);
-
-    // printf("Primesc : ");
-    // for (int i = 0; i < new_buf_size; i++) {
-    //     printf("%x ", buf[i]);
-    // }
-    // printf("\n");
-    if (flag == 3) {
-        unsigned char bcc_ua = A_UA ^ C_UA;
-        unsigned char ua[5] = {F, A_UA, C_UA, bcc_ua, F};
-
-        int bytes = write(connection_fd, ua, 5);
-        if (bytes != 5) {
-            perror(
-                "UAFRAME (5 bytes) not sent in "
-                "llopen_rx()\n");
-            exit(-1);
+    if (c->params.arqMode == ArqSelectiveRepeat) {
+        // the receiver holds what came after, only the oldest is due
+        printf("Timeout. Resending frame %d!\n\n", c->ns_base);
+        resend_frame(c, c->ns_base);
+    } else {
+        printf("Timeout. Resending %d frame(s)!\n\n", window_count(c));
+        resend_from(c, c->ns_base);
+    }
+    timer_start(c, c->rto);
+    return 1;
+}
+
+////////////////////////////////////////////////
+// HANDLING RR / REJ / SREJ
+////////////////////////////////////////////////
+void handle_ack(LinkConnection* c) {
+    unsigned char type = c->rx_type;
+    int nr = c->rx_seq;
+
+    if (type == C_SREJ) {
+        if (seq_dist(c, c->ns_base, nr) < window_count(c)) {
+            printf("Received SREJ. Resending frame %d!\n\n", nr);
+            frame_outcome(c, TRUE);
+            resend_frame(c, nr);
         }
-        printf("Additional UA required\n");
-        return 1;
+        return;
     }
-    if (flag == 0)  // I received the expected packet but it is malformed
-    {
-        printf("Frame NOT OK!\n");
-        send_rej(expected_color, connection_fd);
-        goto waiting;
+    if (type != C_RR && type != C_REJ) return;
 
-    } else if (flag == 2)  // I received a duplicate of the last packet
-    {
-        printf("Duplicate frame!\n");
-        send_rr(expected_color, connection_fd);
-        goto waiting;
+    // RR(nr) and REJ(nr) both acknowledge everything before nr
+    int acked = seq_dist(c, c->ns_base, nr);
+    if (acked > window_count(c)) return;  // stale or bogus
 
-    } else {  // Everything was ok!
-        printf("Frame OK!\n");
-        send_rr((expected_color + 1) % 2, connection_fd);
+    if (acked > 0) {
+        // nr - 1 is the newest frame acknowledged
+        int last = window_slot(c, seq_add(c, nr, c->params.seqModulus - 1));
+        if (!c->resent[last]) rtt_sample(c, now_ms() - c->sent_at[last]);
+    }
+    c->ns_base = nr;
+    c->acked_total += acked;
+    for (int i = 0; i < acked; i++) frame_outcome(c, FALSE);
+
+    if (type == C_REJ && window_count(c) > 0) {
+        printf("Received REJ. Resending from frame %d!\n\n", nr);
+        frame_outcome(c, TRUE);
+        resend_from(c, nr);
+    } else if (acked == 0)
+        return;
+    else
+        printf("Frame acknowledged succesfully!\n\n");
 
-        memcpy(packet, buf + 4, new_buf_size - 4 - 2);
-        return new_buf_size - 6;
+    c->retries = 0;
+    if (window_count(c) > 0)
+        timer_start(c, c->rto);
+    else
+        timer_stop(c);
+}
+
+////////////////////////////////////////////////
+// WAITING FOR RR / REJ
+////////////////////////////////////////////////
+// blocks until at most max_outstanding frames are unacknowledged
+// return 1 on success, 0 when the peer stopped answering
+int wait_for_acks(LinkConnection* c, int max_outstanding) {
+    while (window_count(c) > max_outstanding) {
+        if (receive_frame(c, TRUE))
+            handle_ack(c);
+        else if (retransmit_on_timeout(c) == 0)
+            return 0;
     }
+    return 1;
+}
 
-    return 0;
+// transmitter: once the frames in flight are acknowledged, goes back to
+// the configured rate for good
+// return 1, or 0 when the receiver stopped answering
+int rate_fall_back(LinkConnection* c) {
+    if (wait_for_acks(c, 0) == 0) return 0;
+    c->rate_fall_back = FALSE;
+    c->rate_loss = 0;
+    c->params.maxBaudRate = 0;
+    return rate_change(c, c->params.baudRate);
 }
 
 ////////////////////////////////////////////////
-// LLCLOSE_TRANSMITOR
+// SEND I-FRAME
 ////////////////////////////////////////////////
-int llclose_tx(LinkLayer transmitter, int fd) {
-    alarmCount = 0;
-    STOP = FALSE;
-    alarmEnabled = FALSE;
-    (void)signal(SIGALRM, alarmHandler);
-
-    while (alarmCount <= transmitter.nRetransmissions) {
-        STOP = FALSE;
-
-        if (alarmEnabled == FALSE) {
-            unsigned char bcc_disc = A_DISC_TX ^ C_DISC;
-            unsigned char disc[5] = {F, A_DISC_TX, C_DISC, bcc_disc, F};
-
-            int bytes = write(fd, disc, 5);
-            if (bytes != 5) {
-                perror("DISCFRAME (5 bytes) not sent in llclose_tx()\n");
-                exit(-1);
-            }
-            alarm(transmitter.timeout);
-            alarmEnabled = TRUE;
+// sends the frame already in the window slot of ns_next
+// return the bytes written, or 0 when the peer stopped answering
+int send_i_frame(LinkConnection* c, int slot) {
+    if (window_count(c) == 0) timer_start(c, c->rto);
+    c->ns_next = seq_add(c, c->ns_next, 1);
+
+    int bytes = transport_write(c->t, c->window[slot], c->window_size[slot]);
+    if (bytes < 0) {
+        perror("Write error in llwrite()\n");
+        exit(-1);
+    }
+    c->sent_at[slot] = now_ms();
+    c->resent[slot] = FALSE;
+    printf("Frame sent!\n");
 
-            unsigned char buf[BUF_SIZE] = {0};
+    // take in the acknowledgements that arrived meanwhile, so RTT samples
+    // stay accurate and lost frames are resent without waiting for a full
+    // window
+    while (receive_frame(c, FALSE)) handle_ack(c);
+    if (timer_remaining(c) == 0 && retransmit_on_timeout(c) == 0) return 0;
 
-            int i = 0;
-            while (STOP == FALSE) {
-                int bytes = read(fd, buf + i, 1);
-                if (bytes > 1) {
-                    perror("Invalid reading!\n");
-                    continue;
-                }
+    return bytes;
+}
 
-                if (i == 0) {
-                    if (buf[i] == F) {
-                        i++;
-                    }
-                    continue;
-                }
+////////////////////////////////////////////////
+// PREPARED FRAMES
+////////////////////////////////////////////////
+// encodes queued frames in order, at the FEC level each was queued with;
+// touches nothing of the connection but its profile and the queue
+void* encoder_main(void* arg) {
+    LinkConnection* c = arg;
+
+    pthread_mutex_lock(&c->prep_lock);
+    for (;;) {
+        while (!c->encoder_stop && c->prep_next == c->prep_tail)
+            pthread_cond_wait(&c->prep_queued, &c->prep_lock);
+        if (c->encoder_stop) break;
+        PreparedFrame* p = &c->prep[c->prep_next++ % PREPARE_DEPTH];
+        pthread_mutex_unlock(&c->prep_lock);
+
+        p->frame_size = encode_frame_at(c, p->frame, C_I, p->seq, p->data,
+                                        p->size, p->level, c->prep_fec_buf);
+
+        pthread_mutex_lock(&c->prep_lock);
+        p->encoded = TRUE;
+        pthread_cond_signal(&c->prep_encoded);
+    }
+    pthread_mutex_unlock(&c->prep_lock);
+    return NULL;
+}
 
-                if (i == 1) {
-                    if (buf[i] == A_DISC_RX) {
-                        i++;
-                        continue;
-                    }
-                    if (buf[i] == F) {
-                        continue;
-                    }
-                    i = 0;
-                    continue;
-                }
+void encoder_start(LinkConnection* c) {
+    int capacity = frame_capacity(c, c->max_payload);
+    for (int i = 0; i < PREPARE_DEPTH; i++) {
+        c->prep[i].data = alloc_or_die(c->max_payload);
+        c->prep[i].frame = alloc_or_die(capacity);
+    }
+    if (c->params.fecMaxParity > 0) c->prep_fec_buf = alloc_or_die(c->fec_capacity);
+
+    pthread_mutex_init(&c->prep_lock, NULL);
+    pthread_cond_init(&c->prep_queued, NULL);
+    pthread_cond_init(&c->prep_encoded, NULL);
+    c->encoder_stop = FALSE;
+    if (pthread_create(&c->encoder, NULL, encoder_main, c) != 0) {
+        perror("pthread_create");
+        exit(-1);
+    }
+    c->encoder_running = TRUE;
+}
 
-                if (i > 1) {
-                    if (buf[i] != F) {
-                        i++;
-                        continue;
-                    } else {
-                        if (i == 4) {
-                            unsigned char bcc_disc_rx = buf[1] ^ buf[2];
-                            if (bcc_disc_rx == buf[3]) {
-                                if (buf[2] != C_DISC) {
-                                    i = 0;
-                                    continue;
-                                }
-                                printf("DISC frame received!\n");
-                                STOP = TRUE;
-                                goto exit_loops;
-
-                            } else {
-                                i = 0;
-                                continue;
-                            }
-                        } else {
-                            i = 0;
-                            continue;
-                        }
-                    }
-                }
-            }
-            // for (int j = 0; j < 5; j++) {
-            //     printf("%x\n", buf[j]);
-            // }
-        }
+////////////////////////////////////////////////
+// LLPREPARE
+////////////////////////////////////////////////
+int llprepare(int connection_fd, const unsigned char* buf, int bufSize) {
+    LinkConnection* c = conn_get(connection_fd);
+    if (c == NULL || bufSize <= 0 || bufSize > c->max_payload) return -1;
+    if (c->prep_tail - c->prep_head == PREPARE_DEPTH) return 0;
+    if (!c->encoder_running) encoder_start(c);
+
+    // frames go out in the order they are queued, after those in flight
+    if (c->prep_head == c->prep_tail) c->prep_seq = c->ns_next;
+    PreparedFrame* p = &c->prep[c->prep_tail % PREPARE_DEPTH];
+    memcpy(p->data, buf, bufSize);
+    p->size = bufSize;
+    p->seq = c->prep_seq;
+    p->level = c->fec_level;
+    p->encoded = FALSE;
+    c->prep_seq = seq_add(c, c->prep_seq, 1);
+
+    pthread_mutex_lock(&c->prep_lock);
+    c->prep_tail++;
+    pthread_cond_signal(&c->prep_queued);
+    pthread_mutex_unlock(&c->prep_lock);
+    return 1;
+}
+
+////////////////////////////////////////////////
+// LLSEND
+////////////////////////////////////////////////
+int llsend(int connection_fd) {
+    LinkConnection* c = conn_get(connection_fd);
+    if (c == NULL || c->prep_head == c->prep_tail) return -1;
+
+    if (c->rate_fall_back && rate_fall_back(c) == 0) return 0;
+    // the encoder keeps working while this waits for room in the window
+    if (wait_for_acks(c, c->params.windowSize - 1) == 0) return 0;
+
+    PreparedFrame* p = &c->prep[c->prep_head % PREPARE_DEPTH];
+    pthread_mutex_lock(&c->prep_lock);
+    while (!p->encoded) pthread_cond_wait(&c->prep_encoded, &c->prep_lock);
+    pthread_mutex_unlock(&c->prep_lock);
+
+    // the line got worse since it was queued: more parity, as a resend
+    // would get
+    if (p->level < c->fec_level || p->seq != c->ns_next) {
+        p->frame_size =
+            encode_frame(c, p->frame, C_I, c->ns_next, p->data, p->size);
+        p->level = c->fec_level;
     }
 
-    unsigned char bcc_ua = 0x00;
-    unsigned char ua[5] = {0};
+    // the buffers trade places with the window slot's, no copy
+    int slot = window_slot(c, c->ns_next);
+    unsigned char* frame = c->window[slot];
+    c->window[slot] = p->frame;
+    c->window_size[slot] = p->frame_size;
+    p->frame = frame;
+    if (c->window_data[slot] != NULL) {
+        unsigned char* data = c->window_data[slot];
+        c->window_data[slot] = p->data;
+        c->window_data_size[slot] = p->size;
+        c->window_level[slot] = p->level;
+        p->data = data;
+    }
 
-exit_loops:
+    pthread_mutex_lock(&c->prep_lock);
+    c->prep_head++;
+    pthread_mutex_unlock(&c->prep_lock);
 
-    bcc_ua = A_DISC_RX ^ C_UA;
-    ua[0] = F;
-    ua[1] = A_DISC_RX;
-    ua[2] = C_UA;
-    ua[3] = bcc_ua;
-    ua[4] = F;
+    return send_i_frame(c, slot);
+}
 
-    int bytes = write(fd, ua, 5);
-    if (bytes != 5) {
-        perror(
-            "UAFRAME (5 bytes) not sent in "
-            "llclose_tx()\n");
-        exit(-1);
+////////////////////////////////////////////////
+// LLWRITE
+////////////////////////////////////////////////
+int llwrite(int connection_fd, const unsigned char* buf, int bufSize,
+            LinkLayer link_struct) {
+    LinkConnection* c = conn_get(connection_fd);
+    if (c == NULL || bufSize <= 0 || bufSize > c->max_payload) return -1;
+
+    // frames prepared earlier go first
+    while (c->prep_head != c->prep_tail) {
+        int bytes = llsend(connection_fd);
+        if (bytes <= 0) return bytes;
+    }
+
+    // make room in the window first
+    if (c->rate_fall_back && rate_fall_back(c) == 0) return 0;
+    if (wait_for_acks(c, c->params.windowSize - 1) == 0) return 0;
+
+    int slot = window_slot(c, c->ns_next);
+    c->window_size[slot] =
+        encode_frame(c, c->window[slot], C_I, c->ns_next, buf, bufSize);
+    if (c->window_data[slot] != NULL) {
+        memcpy(c->window_data[slot], buf, bufSize);
+        c->window_data_size[slot] = bufSize;
+        c->window_level[slot] = c->fec_level;
     }
-    //printf("llclose_tx() succesful\n");
+    return send_i_frame(c, slot);
+}
+
+////////////////////////////////////////////////
+// LLPAYLOAD
+////////////////////////////////////////////////
+int llpayload(int connection_fd) {
+    LinkConnection* c = conn_get(connection_fd);
+    if (c == NULL) return -1;
+    return c->payload;
+}
 
+////////////////////////////////////////////////
+// LLPARAMETERS
+////////////////////////////////////////////////
+int llparameters(int connection_fd, LinkLayer* params) {
+    LinkConnection* c = conn_get(connection_fd);
+    if (c == NULL) return -1;
+    *params = c->params;
     return 1;
 }
 
 ////////////////////////////////////////////////
-// LLCLOSE_RECEIVER
+// SELECTIVE REPEAT: OUT OF SEQUENCE FRAME
 ////////////////////////////////////////////////
-int llclose_rx(LinkLayer receiver, int fd) {
-    unsigned char buf[BUF_SIZE] = {0};
+// the decoder already wrote the data field into the reorder slot if it was
+// free
+void store_out_of_order(LinkConnection* c) {
+    int ns = c->rx_seq;
+    if (seq_dist(c, c->nr_expected, ns) >= c->params.windowSize) {
+        printf("Duplicate frame!\n");
+        send_rr(c, c->nr_expected);
+        return;
+    }
+    if (c->rx_size < 0) {
+        printf("Frame NOT OK!\n");
+        send_srej(c, ns);
+        return;
+    }
 
-    STOP = FALSE;
+    int slot = reorder_slot(c, ns);
+    if (c->reorder_size[slot] < 0) {
+        c->reorder_size[slot] = c->rx_size;
+        c->srej_sent[slot] = FALSE;
+    }
+    printf("Out of sequence frame buffered!\n");
 
-    int i = 0;
-    while (STOP == FALSE) {
-        int bytes = read(fd, buf + i, 1);
-        if (bytes > 1) {
-            perror("Invalid reading!\n");
-            continue;
+    // everything still missing before it was lost on the way
+    for (int seq = c->nr_expected; seq != ns; seq = seq_add(c, seq, 1))
+        if (c->reorder_size[reorder_slot(c, seq)] < 0) send_srej(c, seq);
+}
+
+// hands frame nr_expected to the caller and acknowledges it
+void deliver_frame(LinkConnection* c) {
+    int slot = reorder_slot(c, c->nr_expected);
+    c->reorder_size[slot] = -1;
+    c->srej_sent[slot] = FALSE;
+
+    c->nr_expected = seq_add(c, c->nr_expected, 1);
+    c->delivered_total++;
+    c->rej_sent = FALSE;
+    send_rr(c, c->nr_expected);
+}
+
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
+// packet must hold the connection's maximum payload: in-sequence data is
+// decoded straight into it
+int llread(int connection_fd, unsigned char* packet) {
+    LinkConnection* c = conn_get(connection_fd);
+    if (c == NULL) return -1;
+
+    // the next frame may already be waiting in the reorder buffer
+    if (c->params.arqMode == ArqSelectiveRepeat) {
+        int data_size = c->reorder_size[reorder_slot(c, c->nr_expected)];
+        if (data_size >= 0) {
+            memcpy(packet, c->reorder[reorder_slot(c, c->nr_expected)],
+                   data_size);
+            printf("Frame OK (reordered)!\n");
+            deliver_frame(c);
+            return data_size;
         }
-        //printf("%x, i=%d\n", buf[i], i);
+    }
 
-        if (i == 0) {
-            if (buf[i] == F) {
-                i++;
-            }
+    // the transmitter gives up after nRetransmissions timeouts in a row, so
+    // a longer silence means the link is gone
+    timer_start(c, (c->params.nRetransmissions + 2) * c->params.timeout * 1000);
+    c->rx_packet = packet;
+    while (receive_frame(c, TRUE)) {
+        int ns = c->rx_seq;
+
+        if (c->rx_type == C_SET && c->rx_address == A_RATE) {
+            answer_rate(c);
             continue;
         }
-
-        if (i == 1) {
-            if (buf[i] == A_DISC_TX) {
-                i++;
-                continue;
-            }
-            if (buf[i] == F) {
-                continue;
-            }
-            i = 0;
+        if (c->rx_type == C_SET) {  // our UA was lost on the way to TX
+            answer_set(c);
+            printf("Additional UA required\n");
             continue;
         }
+        if (c->rx_type != C_I) continue;
 
-        if (i > 1) {
-            if (buf[i] != F) {
-                i++;
-                continue;
-            } else {
-                if (i == 4) {
-                    unsigned char bcc_disc = buf[1] ^ buf[2];
-                    if (bcc_disc == buf[3]) {
-                        if (buf[2] != C_DISC) {
-                            i = 0;
-                            continue;
-                        }
-
-                        STOP = TRUE;
-
-                        unsigned char bcc_disc = A_DISC_RX ^ C_DISC;
-                        unsigned char disc[5] = {F, A_DISC_RX, C_DISC, bcc_disc,
-                                                 F};
-
-                        int bytes = write(fd, disc, 5);
-                        if (bytes != 5) {
-                            perror(
-                                "DISCFRAME (5 bytes) not sent in "
-                                "llclose_rx()\n");
-                            exit(-1);
-                        }
-
-                    } else {
-                        i = 0;
-                        continue;
-                    }
-                } else {
-                    i = 0;
-                    continue;
+        if (c->params.arqMode == ArqSelectiveRepeat && ns != c->nr_expected) {
+            store_out_of_order(c);
+            continue;
+        }
+        if (ns != c->nr_expected) {
+            if (seq_dist(c, c->nr_expected, ns) < c->params.windowSize) {
+                // a frame before this one was lost
+                printf("Out of sequence frame!\n");
+                if (!c->rej_sent) {
+                    send_rej(c, c->nr_expected);
+                    c->rej_sent = TRUE;
                 }
+            } else {
+                printf("Duplicate frame!\n");
+                send_rr(c, c->nr_expected);
             }
-        }
-    }
-
-    i = 0;
-    STOP = FALSE;
-    while (STOP == FALSE) {
-        int bytes = read(fd, buf + i, 1);
-        if (bytes > 1) {
-            perror("Invalid reading!\n");
             continue;
         }
 
-        if (i == 0) {
-            if (buf[i] == F) {
-                i++;
+        if (c->rx_size < 0) {
+            printf("Frame NOT OK!\n");
+            if (c->params.arqMode == ArqSelectiveRepeat)
+                send_srej(c, c->nr_expected);
+            else {
+                send_rej(c, c->nr_expected);
+                c->rej_sent = TRUE;
             }
             continue;
         }
 
-        if (i == 1) {
-            if (buf[i] == A_DISC_RX) {
-                i++;
-                continue;
-            }
-            if (buf[i] == F) {
-                continue;
+        printf("Frame OK!\n");
+        c->rx_packet = NULL;
+        timer_stop(c);
+        deliver_frame(c);
+        return c->rx_size;
+    }
+
+    printf("Link lost in llread()\n");
+    c->rx_packet = NULL;
+    timer_stop(c);
+    return -1;
+}
+
+////////////////////////////////////////////////
+// LLCLOSE_TRANSMITOR
+////////////////////////////////////////////////
+int llclose_tx(LinkLayer transmitter, int fd) {
+    LinkConnection* c = conn_get(fd);
+
+    for (int tries = 0; tries <= transmitter.nRetransmissions; tries++) {
+        send_u_frame(c, A_DISC_TX, C_DISC);
+
+        timer_start(c, c->rto);
+
+        unsigned char address, control;
+        while (receive_u_frame(c, &address, &control)) {
+            if (address == A_DISC_RX && control == C_DISC) {
+                timer_stop(c);
+                printf("DISC frame received!\n");
+
+                send_u_frame(c, A_DISC_RX, C_UA);
+                return 1;
             }
-            i = 0;
-            continue;
         }
+        rto_backoff(c);
+    }
 
-        if (i > 1) {
-            if (buf[i] != F) {
-                i++;
-                continue;
-            } else {
-                if (i == 4) {
-                    unsigned char bcc_ua = buf[1] ^ buf[2];
-                    if (bcc_ua == buf[3]) {
-                        if (buf[2] != C_UA) {
-                            i = 0;
-                            continue;
-                        }
-                        STOP = TRUE;
-                        return 1;
-                    } else {
-                        i = 0;
-                        continue;
-                    }
-                } else {
-                    i = 0;
-                    continue;
-                }
+    timer_stop(c);
+    printf("llclose_tx() unsuccesful\n");
+    return 0;
+}
+
+////////////////////////////////////////////////
+// LLCLOSE_RECEIVER
+////////////////////////////////////////////////
+int llclose_rx(LinkLayer receiver, int fd) {
+    LinkConnection* c = conn_get(fd);
+    unsigned char address, control;
+
+    // as in llread(), a transmitter that stays silent this long is gone
+    timer_start(c, (receiver.nRetransmissions + 2) * receiver.timeout * 1000);
+    while (TRUE) {
+        if (!receive_u_frame(c, &address, &control)) {
+            timer_stop(c);
+            printf("llclose_rx() unsuccesful\n");
+            return 0;
+        }
+        if (address == A_DISC_TX && control == C_DISC) break;
+    }
+
+    // answer with DISC until the UA arrives; a repeated DISC means ours
+    // was lost
+    for (int tries = 0; tries <= receiver.nRetransmissions; tries++) {
+        send_u_frame(c, A_DISC_RX, C_DISC);
+
+        timer_start(c, c->rto);
+
+        while (receive_u_frame(c, &address, &control)) {
+            if (address == A_DISC_RX && control == C_UA) {
+                timer_stop(c);
+                return 1;
             }
+            if (address == A_DISC_TX && control == C_DISC) break;
         }
+        rto_backoff(c);
     }
+
+    timer_stop(c);
     printf("llclose_rx() unsuccesful\n");
     return 0;
 }
@@ -910,21 +2035,25 @@ int llclose_rx(LinkLayer receiver, int fd) {
 // LLCLOSE
 ////////////////////////////////////////////////
 int llclose(int fd, LinkLayer connectionParameters, int showStatistics) {
-    // TODO
+    LinkConnection* c = conn_get(fd);
+    if (c == NULL) return -1;
+
+    int ok = -1;
     if (connectionParameters.role == LlRx) {
-        if (llclose_rx(connectionParameters, fd) > 0) {
-            int ok = close(fd);
-            if (ok == 0) return 1;
-            return ok;
-        }
+        if (llclose_rx(connectionParameters, fd) > 0) ok = 1;
 
     } else if (connectionParameters.role == LlTx) {
-        if (llclose_tx(connectionParameters, fd) > 0) {
-            int ok = close(fd);
-            if (ok == 0) return 1;
-            return ok;
-        }
+        // every queued I-frame must be sent and acknowledged before DISC
+        int sent = 1;
+        while (sent > 0 && c->prep_head != c->prep_tail) sent = llsend(fd);
+        if (sent == 0 || wait_for_acks(c, 0) == 0)
+            printf("Frames still unacknowledged at llclose()\n");
+        else if (llclose_tx(connectionParameters, fd) > 0)
+            ok = 1;
     }
 
-    return -1;
+    Transport* t = c->t;
+    conn_release(c);
+    if (transport_close(t) < 0) return -1;
+    return ok;
 }
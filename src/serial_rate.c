@@ -0,0 +1,19 @@
+// Serial line rates without a Bxxx constant
+// struct termios2 and BOTHER come from <asm/termbits.h>, which has the
+// layout of the architecture being built for but clashes with <termios.h>,
+// so this is kept apart from the transport code.
+
+#include "serial_rate.h"
+
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+int serial_set_any_rate(int fd, int rate) {
+    struct termios2 tio2;
+    if (ioctl(fd, TCGETS2, &tio2) == -1) return -1;
+    tio2.c_cflag &= ~CBAUD;
+    tio2.c_cflag |= BOTHER;
+    tio2.c_ispeed = rate;
+    tio2.c_ospeed = rate;
+    return ioctl(fd, TCSETS2, &tio2) == 0 ? 1 : -1;
+}
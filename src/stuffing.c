@@ -0,0 +1,243 @@
+// Byte stuffing kernels
+// Clean runs (no F / ESC) are found 16 or 32 bytes at a time and copied in
+// bulk; the implementation is picked once at runtime from what the CPU
+// supports, with a portable scalar fallback.
+
+#include "stuffing.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+////////////////////////////////////////////////
+// SCALAR
+////////////////////////////////////////////////
+static int find_special_scalar(const unsigned char *buf, int size) {
+    for (int i = 0; i < size; i++)
+        if (buf[i] == F || buf[i] == ESC) return i;
+    return size;
+}
+
+static unsigned char xor_bytes_scalar(const unsigned char *buf, int size) {
+    unsigned long long acc = 0;
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, buf + i, 8);
+        acc ^= word;
+    }
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+
+    unsigned char x = acc;
+    for (; i < size; i++) x ^= buf[i];
+    return x;
+}
+
+#ifdef HAVE_X86_KERNELS
+////////////////////////////////////////////////
+// SSE2
+////////////////////////////////////////////////
+__attribute__((target("sse2"))) static int find_special_sse2(
+    const unsigned char *buf, int size) {
+    const __m128i flag = _mm_set1_epi8(F);
+    const __m128i esc = _mm_set1_epi8(ESC);
+
+    int i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        int mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc)));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return i + find_special_scalar(buf + i, size - i);
+}
+
+__attribute__((target("sse2"))) static unsigned char xor_bytes_sse2(
+    const unsigned char *buf, int size) {
+    __m128i acc = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 16 <= size; i += 16)
+        acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *)(buf + i)));
+
+    unsigned char lanes[16];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return xor_bytes_scalar(lanes, 16) ^ xor_bytes_scalar(buf + i, size - i);
+}
+
+////////////////////////////////////////////////
+// AVX2
+////////////////////////////////////////////////
+__attribute__((target("avx2"))) static int find_special_avx2(
+    const unsigned char *buf, int size) {
+    const __m256i flag = _mm256_set1_epi8(F);
+    const __m256i esc = _mm256_set1_epi8(ESC);
+
+    int i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, flag), _mm256_cmpeq_epi8(v, esc)));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return i + find_special_sse2(buf + i, size - i);
+}
+
+__attribute__((target("avx2"))) static unsigned char xor_bytes_avx2(
+    const unsigned char *buf, int size) {
+    __m256i acc = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i + 32 <= size; i += 32)
+        acc = _mm256_xor_si256(acc,
+                               _mm256_loadu_si256((const __m256i *)(buf + i)));
+
+    unsigned char lanes[32];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return xor_bytes_scalar(lanes, 32) ^ xor_bytes_sse2(buf + i, size - i);
+}
+#endif
+
+////////////////////////////////////////////////
+// DISPATCH
+////////////////////////////////////////////////
+static int (*find_special_impl)(const unsigned char *, int) = NULL;
+static unsigned char (*xor_bytes_impl)(const unsigned char *, int) = NULL;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void pick_kernels() {
+    find_special_impl = find_special_scalar;
+    xor_bytes_impl = xor_bytes_scalar;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_special_impl = find_special_avx2;
+        xor_bytes_impl = xor_bytes_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_special_impl = find_special_sse2;
+        xor_bytes_impl = xor_bytes_sse2;
+    }
+#endif
+}
+
+int find_special(const unsigned char *buf, int size) {
+    pthread_once(&kernels_once, pick_kernels);
+    return find_special_impl(buf, size);
+}
+
+unsigned char xor_bytes(const unsigned char *buf, int size) {
+    if (size < 16) return xor_bytes_scalar(buf, size);
+    pthread_once(&kernels_once, pick_kernels);
+    return xor_bytes_impl(buf, size);
+}
+
+////////////////////////////////////////////////
+// STUFFING
+////////////////////////////////////////////////
+// a scan that stops within SHORT_RUN bytes did not pay for itself; after
+// SHORT_SCANS of them in a row the next DENSE_BLOCK bytes go byte by byte,
+// and twice as many each time the scan after such a block is short again
+#define SHORT_RUN 8
+#define SHORT_SCANS 4
+#define DENSE_BLOCK 256
+
+static int stuff_scalar(unsigned char *out, const unsigned char *in,
+                        int size) {
+    int n = 0;
+    for (int i = 0; i < size; i++) {
+        if (in[i] == F || in[i] == ESC) {
+            out[n++] = ESC;
+            out[n++] = in[i] ^ 0x20;
+        } else
+            out[n++] = in[i];
+    }
+    return n;
+}
+
+int stuff_bytes(unsigned char *out, const unsigned char *in, int size) {
+    int n = 0;
+    int i = 0;
+    int short_scans = 0;
+    int dense_block = DENSE_BLOCK;
+    while (i < size) {
+        if (short_scans == SHORT_SCANS) {
+            int block = size - i < dense_block ? size - i : dense_block;
+            n += stuff_scalar(out + n, in + i, block);
+            i += block;
+            short_scans = SHORT_SCANS - 1;
+            dense_block *= 2;
+            continue;
+        }
+
+        int run = find_special(in + i, size - i);
+        memcpy(out + n, in + i, run);
+        n += run;
+        i += run;
+        if (run >= SHORT_RUN) {
+            short_scans = 0;
+            dense_block = DENSE_BLOCK;
+        } else
+            short_scans++;
+
+        if (i < size) {
+            out[n++] = ESC;
+            out[n++] = in[i++] ^ 0x20;
+        }
+    }
+    return n;
+}
+
+////////////////////////////////////////////////
+// COBS
+////////////////////////////////////////////////
+static inline unsigned char cobs_code(int run) {
+    return run < F ? run : run + 1;
+}
+
+int cobs_run_length(unsigned char code) { return code < F ? code : code - 1; }
+
+static void cobs_close_run(CobsEncoder *e) {
+    e->out[e->code_pos] = cobs_code(e->run);
+    e->code_pos = e->n++;
+    e->run = 0;
+}
+
+void cobs_begin(CobsEncoder *e, unsigned char *out) {
+    e->out = out;
+    e->code_pos = 0;
+    e->n = 1;
+    e->run = 0;
+}
+
+void cobs_put(CobsEncoder *e, const unsigned char *in, int size) {
+    while (size > 0) {
+        int room = COBS_MAX_RUN - e->run;
+        int chunk = size < room ? size : room;
+        const unsigned char *flag = memchr(in, F, chunk);
+        int len = flag != NULL ? flag - in : chunk;
+
+        memcpy(e->out + e->n, in, len);
+        e->n += len;
+        e->run += len;
+        in += len;
+        size -= len;
+
+        if (flag != NULL) {  // the F itself is implied by the next run
+            in++;
+            size--;
+            cobs_close_run(e);
+        } else if (e->run == COBS_MAX_RUN)
+            cobs_close_run(e);
+    }
+}
+
+int cobs_end(CobsEncoder *e) {
+    e->out[e->code_pos] = cobs_code(e->run);
+    return e->n;
+}
@@ -0,0 +1,449 @@
+// Link transports
+// Each backend fills in a TransportOps table. The serial port is the
+// original termios setup; rates with a Bxxx constant are set through it,
+// any other rate through termios2 and BOTHER. With TRANSPORT_LOW_LATENCY
+// the driver is asked (TIOCSSERIAL) to push each received byte to the tty
+// at once instead of batching it, so poll() wakes with the wire.
+//
+// In-process pairs live in a registry by name:
+// "pipe:" pairs are a socketpair, "shm:" pairs a single-producer
+// single-consumer ring per direction in shared memory, with an eventfd per
+// end to poll() on for data and one per ring for the writer to sleep on
+// while it is full.
+
+#define _GNU_SOURCE
+#include "transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/serial.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "serial_rate.h"
+
+#define PAIR_NAME_SIZE 64
+
+typedef enum
+{
+    PairPipe,
+    PairShm,
+} PairKind;
+
+// ring k is read by end k and written by the other end
+typedef struct
+{
+    atomic_ulong head;  // bytes written so far
+    atomic_ulong tail;  // bytes read so far
+    unsigned char data[SHM_RING_SIZE];
+} ShmRing;
+
+typedef struct
+{
+    ShmRing ring[2];
+    atomic_int closed[2];
+} ShmShared;
+
+typedef struct
+{
+    char name[PAIR_NAME_SIZE];  // "" when the slot is free
+    PairKind kind;
+    int opened[2];
+    int closed[2];
+    int fd[2];     // pipe: the socketpair; shm: ready, posted when ring k fills
+    int room[2];   // shm: posted when ring k drains
+    ShmShared *shm;
+} Pair;
+
+typedef struct
+{
+    int (*read)(Transport *t, unsigned char *buf, int size);
+    int (*write)(Transport *t, const unsigned char *buf, int size);
+    int (*set_rate)(Transport *t, int rate);
+    int (*close)(Transport *t);
+} TransportOps;
+
+struct Transport
+{
+    const TransportOps *ops;
+    int fd;
+    struct termios oldtio;  // serial: settings to restore
+    struct serial_struct oldserial;
+    int serial_restore;     // oldserial was changed
+    Pair *pair;
+    int end;
+};
+
+static Pair pairs[MAX_TRANSPORT_PAIRS];
+static pthread_mutex_t pairs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// waits for POLLIN on fd, retrying after signals
+static int wait_fd(int fd, int timeout_ms) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int ready;
+    do
+        ready = poll(&pfd, 1, timeout_ms);
+    while (ready < 0 && errno == EINTR);
+    return ready < 0 ? -1 : ready > 0;
+}
+
+////////////////////////////////////////////////
+// SERIAL PORT
+////////////////////////////////////////////////
+static int serial_read(Transport *t, unsigned char *buf, int size) {
+    // VMIN = 0, VTIME = 0: returns whatever arrived without waiting
+    int bytes = read(t->fd, buf, size);
+    if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+    return bytes;
+}
+
+static int serial_write(Transport *t, const unsigned char *buf, int size) {
+    return write(t->fd, buf, size) == size ? size : -1;
+}
+
+static const struct
+{
+    int rate;
+    speed_t speed;
+} serial_speeds[] = {
+    {50, B50},           {75, B75},           {110, B110},
+    {134, B134},         {150, B150},         {200, B200},
+    {300, B300},         {600, B600},         {1200, B1200},
+    {1800, B1800},       {2400, B2400},       {4800, B4800},
+    {9600, B9600},       {19200, B19200},     {38400, B38400},
+    {57600, B57600},     {115200, B115200},   {230400, B230400},
+    {460800, B460800},   {500000, B500000},   {576000, B576000},
+    {921600, B921600},   {1000000, B1000000}, {1152000, B1152000},
+    {1500000, B1500000}, {2000000, B2000000}, {2500000, B2500000},
+    {3000000, B3000000}, {3500000, B3500000}, {4000000, B4000000},
+};
+
+// lets what was written go out at the old rate first
+static int serial_set_rate(Transport *t, int rate) {
+    tcdrain(t->fd);
+    for (int i = 0; i < sizeof(serial_speeds) / sizeof(serial_speeds[0]); i++) {
+        if (serial_speeds[i].rate != rate) continue;
+        struct termios tio;
+        if (tcgetattr(t->fd, &tio) == -1) return -1;
+        cfsetispeed(&tio, serial_speeds[i].speed);
+        cfsetospeed(&tio, serial_speeds[i].speed);
+        return tcsetattr(t->fd, TCSANOW, &tio) == 0 ? 1 : -1;
+    }
+    return serial_set_any_rate(t->fd, rate);
+}
+
+static int serial_close(Transport *t) {
+    tcsetattr(t->fd, TCSADRAIN, &t->oldtio);
+    if (t->serial_restore) ioctl(t->fd, TIOCSSERIAL, &t->oldserial);
+    return close(t->fd) == 0 ? 1 : -1;
+}
+
+static const TransportOps serial_ops = {serial_read, serial_write,
+                                        serial_set_rate, serial_close};
+
+// not every driver has the flag (USB adapters, PTYs), which is fine
+static void serial_low_latency(Transport *t) {
+    struct serial_struct serial;
+    if (ioctl(t->fd, TIOCGSERIAL, &serial) == -1) return;
+    t->oldserial = serial;
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(t->fd, TIOCSSERIAL, &serial) == 0) t->serial_restore = 1;
+}
+
+static int serial_open(Transport *t, const char *name, int rate, int flags) {
+    t->fd = open(name, O_RDWR | O_NOCTTY);
+    if (t->fd < 0) return -1;
+
+    /*-----Setarea argumentelor pentru controlul portului serial------*/
+
+    struct termios newtio;
+    // Save current port settings
+    if (tcgetattr(t->fd, &t->oldtio) == -1) {
+        perror("tcgetattr");
+        close(t->fd);
+        return -1;
+    }
+    // Clear struct for new port settings
+    memset(&newtio, 0, sizeof(newtio));
+    newtio.c_cflag = B38400 | CS8 | CLOCAL | CREAD;
+    // RTS/CTS keeps the sender from overrunning the receiver's FIFO
+    if (flags & TRANSPORT_RTS_CTS) newtio.c_cflag |= CRTSCTS;
+    newtio.c_iflag = IGNPAR;
+    newtio.c_oflag = 0;
+    // Set input mode (non-canonical, no echo,...)
+    newtio.c_lflag = 0;
+    newtio.c_cc[VTIME] = 0;  // No inter-character timer, poll() waits
+    newtio.c_cc[VMIN] = 0;   // Non-Blocking read
+    // Now clean the line and activate the settings for the port
+    // tcflush() discards data written to the object referred to
+    // by fd but not transmitted, or data received but not read,
+    // depending on the value of queue_selector:
+    //   TCIFLUSH - flushes data received but not read.
+    tcflush(t->fd, TCIOFLUSH);
+    // Set new port settings
+    if (tcsetattr(t->fd, TCSANOW, &newtio) == -1 ||
+        serial_set_rate(t, rate > 0 ? rate : DEFAULT_BAUDRATE) < 0) {
+        perror("tcsetattr");
+        close(t->fd);
+        return -1;
+    }
+    printf("New termios structure set\n");
+    if (flags & TRANSPORT_LOW_LATENCY) serial_low_latency(t);
+    t->ops = &serial_ops;
+    return 1;
+}
+
+////////////////////////////////////////////////
+// PAIR REGISTRY
+////////////////////////////////////////////////
+// call with pairs_lock held
+static Pair *pair_find(const char *name) {
+    for (int i = 0; i < MAX_TRANSPORT_PAIRS; i++)
+        if (pairs[i].name[0] != '\0' && strcmp(pairs[i].name, name) == 0)
+            return &pairs[i];
+    return NULL;
+}
+
+static void pair_free(Pair *p) {
+    for (int k = 0; k < 2; k++) {
+        if (p->fd[k] >= 0) close(p->fd[k]);
+        if (p->room[k] >= 0) close(p->room[k]);
+    }
+    if (p->shm != NULL) munmap(p->shm, sizeof(ShmShared));
+    memset(p, 0, sizeof(Pair));
+}
+
+int transport_pair(const char *name) {
+    PairKind kind;
+    if (strncmp(name, TRANSPORT_PIPE, strlen(TRANSPORT_PIPE)) == 0)
+        kind = PairPipe;
+    else if (strncmp(name, TRANSPORT_SHM, strlen(TRANSPORT_SHM)) == 0)
+        kind = PairShm;
+    else
+        return -1;
+    if (strlen(name) >= PAIR_NAME_SIZE) return -1;
+
+    pthread_mutex_lock(&pairs_lock);
+    Pair *p = pair_find(name);
+    for (int i = 0; p == NULL && i < MAX_TRANSPORT_PAIRS; i++)
+        if (pairs[i].name[0] == '\0') p = &pairs[i];
+    if (p == NULL || p->name[0] != '\0') {
+        pthread_mutex_unlock(&pairs_lock);
+        return -1;
+    }
+
+    p->kind = kind;
+    p->fd[0] = p->fd[1] = p->room[0] = p->room[1] = -1;
+    int ok;
+    if (kind == PairPipe)
+        ok = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, p->fd) == 0;
+    else {
+        // MAP_SHARED so a pair created before fork() still connects
+        p->shm = mmap(NULL, sizeof(ShmShared), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        ok = p->shm != MAP_FAILED;
+        if (!ok) p->shm = NULL;
+        for (int k = 0; ok && k < 2; k++) {
+            p->fd[k] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            p->room[k] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            ok = p->fd[k] >= 0 && p->room[k] >= 0;
+        }
+    }
+    if (!ok) {
+        pair_free(p);
+        pthread_mutex_unlock(&pairs_lock);
+        return -1;
+    }
+    strcpy(p->name, name);
+    pthread_mutex_unlock(&pairs_lock);
+    return 1;
+}
+
+// the pair is freed with its second end
+static int pair_close(Transport *t) {
+    pthread_mutex_lock(&pairs_lock);
+    Pair *p = t->pair;
+    p->closed[t->end] = 1;
+    if (p->closed[0] && p->closed[1]) pair_free(p);
+    pthread_mutex_unlock(&pairs_lock);
+    return 1;
+}
+
+////////////////////////////////////////////////
+// SOCKETPAIR
+////////////////////////////////////////////////
+static int pipe_read(Transport *t, unsigned char *buf, int size) {
+    int bytes = recv(t->fd, buf, size, MSG_DONTWAIT);
+    if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+    return bytes > 0 ? bytes : -1;  // 0 is end of file
+}
+
+static int pipe_write(Transport *t, const unsigned char *buf, int size) {
+    for (int done = 0; done < size;) {
+        int bytes = send(t->fd, buf + done, size - done, MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0) return -1;
+        done += bytes;
+    }
+    return size;
+}
+
+// shuts the socket down so the peer reads end of file, even though the
+// descriptor stays open until the pair is freed
+static int pipe_close(Transport *t) {
+    shutdown(t->fd, SHUT_RDWR);
+    return pair_close(t);
+}
+
+// pairs have no line rate
+static int pair_set_rate(Transport *t, int rate) { return 1; }
+
+static const TransportOps pipe_ops = {pipe_read, pipe_write, pair_set_rate,
+                                      pipe_close};
+
+////////////////////////////////////////////////
+// SHARED MEMORY RING
+////////////////////////////////////////////////
+static void event_post(int fd) {
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+static void event_clear(int fd) {
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+    }
+}
+
+// the event is cleared before the ring is looked at, so a post that comes
+// after it is never lost
+static int shm_read(Transport *t, unsigned char *buf, int size) {
+    Pair *p = t->pair;
+    ShmRing *ring = &p->shm->ring[t->end];
+    event_clear(p->fd[t->end]);
+
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) return atomic_load(&p->shm->closed[!t->end]) ? -1 : 0;
+
+    int bytes = head - tail < (unsigned long)size ? (int)(head - tail) : size;
+    int at = tail % SHM_RING_SIZE;
+    int first = SHM_RING_SIZE - at < bytes ? SHM_RING_SIZE - at : bytes;
+    memcpy(buf, ring->data + at, first);
+    memcpy(buf + first, ring->data, bytes - first);
+    atomic_store_explicit(&ring->tail, tail + bytes, memory_order_release);
+    event_post(p->room[t->end]);
+    // what did not fit in buf is still to be polled for
+    if (head - tail > (unsigned long)bytes) event_post(p->fd[t->end]);
+    return bytes;
+}
+
+static int shm_write(Transport *t, const unsigned char *buf, int size) {
+    Pair *p = t->pair;
+    int k = !t->end;
+    ShmRing *ring = &p->shm->ring[k];
+
+    for (int done = 0; done < size;) {
+        event_clear(p->room[k]);
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        int space = SHM_RING_SIZE - (head - tail);
+        if (space == 0) {
+            if (atomic_load(&p->shm->closed[k])) return -1;
+            if (wait_fd(p->room[k], -1) < 0) return -1;
+            continue;
+        }
+
+        int bytes = size - done < space ? size - done : space;
+        int at = head % SHM_RING_SIZE;
+        int first = SHM_RING_SIZE - at < bytes ? SHM_RING_SIZE - at : bytes;
+        memcpy(ring->data + at, buf + done, first);
+        memcpy(ring->data, buf + done + first, bytes - first);
+        atomic_store_explicit(&ring->head, head + bytes, memory_order_release);
+        event_post(p->fd[k]);
+        done += bytes;
+    }
+    return size;
+}
+
+// wakes the peer whether it waits for data or for room
+static int shm_close(Transport *t) {
+    Pair *p = t->pair;
+    atomic_store(&p->shm->closed[t->end], 1);
+    event_post(p->fd[!t->end]);
+    event_post(p->room[t->end]);
+    return pair_close(t);
+}
+
+static const TransportOps shm_ops = {shm_read, shm_write, pair_set_rate,
+                                     shm_close};
+
+////////////////////////////////////////////////
+// TRANSPORT
+////////////////////////////////////////////////
+Transport *transport_open(const char *name, int end, int rate, int flags) {
+    Transport *t = calloc(1, sizeof(Transport));
+    if (t == NULL) return NULL;
+
+    int pipe = strncmp(name, TRANSPORT_PIPE, strlen(TRANSPORT_PIPE)) == 0;
+    int shm = strncmp(name, TRANSPORT_SHM, strlen(TRANSPORT_SHM)) == 0;
+    if (!pipe && !shm) {
+        if (serial_open(t, name, rate, flags) < 0) {
+            free(t);
+            return NULL;
+        }
+        return t;
+    }
+
+    pthread_mutex_lock(&pairs_lock);
+    Pair *p = pair_find(name);
+    if (p == NULL || end < 0 || end > 1 || p->opened[end]) {
+        pthread_mutex_unlock(&pairs_lock);
+        free(t);
+        return NULL;
+    }
+    p->opened[end] = 1;
+    pthread_mutex_unlock(&pairs_lock);
+
+    t->ops = p->kind == PairPipe ? &pipe_ops : &shm_ops;
+    t->fd = p->fd[end];
+    t->pair = p;
+    t->end = end;
+    return t;
+}
+
+int transport_fd(const Transport *t) { return t->fd; }
+
+int transport_read(Transport *t, unsigned char *buf, int size) {
+    return t->ops->read(t, buf, size);
+}
+
+int transport_write(Transport *t, const unsigned char *buf, int size) {
+    return t->ops->write(t, buf, size);
+}
+
+int transport_set_rate(Transport *t, int rate) {
+    return t->ops->set_rate(t, rate);
+}
+
+int transport_wait(Transport *t, int timeout_ms) {
+    return wait_fd(t->fd, timeout_ms);
+}
+
+int transport_close(Transport *t) {
+    int ok = t->ops->close(t);
+    free(t);
+    return ok;
+}
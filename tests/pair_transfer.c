@@ -0,0 +1,138 @@
+// In-process transfer test
+// Runs transfers between two threads of this process over "pipe:" and
+// "shm:" pairs (transport.h), through llopen / llwrite / llread / llclose,
+// for each ARQ mode, framing and FCS, and checks that the receiver got
+// exactly the frames that were written, in order.
+//
+// Usage: pair_transfer [rounds] (default 2). Build and run with tests/run.sh.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "link_layer.h"
+#include "transport.h"
+
+#define FRAMES 400
+#define MAX_FRAME 4096
+
+typedef struct
+{
+    char name[50];
+    LinkArqMode arqMode;
+    LinkFraming framing;
+    LinkFcsType fcsType;
+    unsigned char *received; // FRAMES * MAX_FRAME bytes
+    int sizes[FRAMES];
+    int frames;
+} Transfer;
+
+// Frame n of a transfer: its size and bytes, the same on every run.
+static int make_frame(int n, unsigned char *buf) {
+    unsigned long long state = n * 0x9E3779B97F4A7C15ULL + 1;
+    int size = 1 + (n * 7919) % MAX_FRAME;
+    for (int i = 0; i < size; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        buf[i] = state >> 56;
+    }
+    // now and then a run of flag and escape bytes, for the framing
+    if (n % 5 == 0)
+        for (int i = 0; i < size; i += 3) buf[i] = i % 2 ? 0x7e : 0x7d;
+    return size;
+}
+
+static LinkLayer parameters(const Transfer *t, LinkLayerRole role) {
+    LinkLayer l;
+    memset(&l, 0, sizeof(l));
+    strcpy(l.serialPort, t->name);
+    l.role = role;
+    l.baudRate = 38400;
+    l.nRetransmissions = 3;
+    l.timeout = 1;
+    l.arqMode = t->arqMode;
+    l.windowSize = t->arqMode == ArqStopAndWait ? 1 : 16;
+    l.seqModulus = t->arqMode == ArqStopAndWait ? 2 : 128;
+    l.fcsType = t->fcsType;
+    l.framing = t->framing;
+    l.maxPayload = MAX_FRAME;
+    l.packetVersion = 2;
+    return l;
+}
+
+static void *receiver(void *arg) {
+    Transfer *t = arg;
+    LinkLayer l = parameters(t, LlRx);
+    int fd = llopen(l);
+    if (fd <= 0) return NULL;
+
+    while (t->frames < FRAMES) {
+        int bytes = llread(fd, t->received + t->frames * MAX_FRAME);
+        if (bytes < 0) break;
+        t->sizes[t->frames++] = bytes;
+    }
+    llclose(fd, l, 0);
+    return NULL;
+}
+
+// Return "1" when every frame arrived intact, "0" otherwise.
+static int transfer(Transfer *t) {
+    static unsigned char frame[MAX_FRAME];
+    pthread_t thread;
+
+    t->frames = 0;
+    if (transport_pair(t->name) < 0) return 0;
+    if (pthread_create(&thread, NULL, receiver, t) != 0) return 0;
+
+    LinkLayer l = parameters(t, LlTx);
+    int fd = llopen(l);
+    int ok = fd > 0;
+    for (int n = 0; ok && n < FRAMES; n++) {
+        int size = make_frame(n, frame);
+        ok = llwrite(fd, frame, size, l) > 0;
+    }
+    if (fd > 0) llclose(fd, l, 0);
+    pthread_join(thread, NULL);
+
+    for (int n = 0; ok && n < FRAMES; n++) {
+        int size = make_frame(n, frame);
+        ok = n < t->frames && t->sizes[n] == size &&
+             memcmp(t->received + n * MAX_FRAME, frame, size) == 0;
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    const char *kinds[] = {TRANSPORT_PIPE, TRANSPORT_SHM};
+    const char *arq[] = {"stop-and-wait", "go-back-n", "selective-repeat"};
+    const char *framing[] = {"hdlc", "cobs"};
+    const char *fcs[] = {"bcc", "crc16", "crc32c"};
+    int rounds = argc > 1 ? atoi(argv[1]) : 2;
+    int failed = 0, runs = 0;
+
+    Transfer t;
+    t.received = malloc(FRAMES * MAX_FRAME);
+    if (t.received == NULL) return 1;
+
+    for (int round = 0; round < rounds; round++)
+        for (int k = 0; k < 2; k++)
+            for (int a = ArqStopAndWait; a <= ArqSelectiveRepeat; a++)
+                for (int f = FramingHdlc; f <= FramingCobs; f++)
+                    for (int c = FcsBcc; c <= FcsCrc32; c++) {
+                        snprintf(t.name, sizeof(t.name), "%stest%d", kinds[k], runs);
+                        t.arqMode = a;
+                        t.framing = f;
+                        t.fcsType = c;
+                        runs++;
+                        if (!transfer(&t)) {
+                            failed++;
+                            fprintf(stderr, "FAIL %s %s %s %s: %d of %d frames\n",
+                                    kinds[k], arq[a], framing[f], fcs[c],
+                                    t.frames, FRAMES);
+                        }
+                    }
+
+    fprintf(stderr, "%d of %d transfers passed\n", runs - failed, runs);
+    free(t.received);
+    return failed > 0;
+}
@@ -0,0 +1,13 @@
+#!/bin/sh
+# Build and run the in-process transfer test against the link layer and
+# transports in src/.
+# The link layer reports every frame on stdout, so only the test's own
+# results (on stderr) are shown.
+# Usage: tests/run.sh [rounds] (from the project root)
+set -e
+
+BUILD=bin/tests
+mkdir -p $BUILD
+gcc -Wall -o $BUILD/pair_transfer tests/pair_transfer.c \
+    $(ls src/*.c | grep -v application_layer) -Iinclude -pthread
+./$BUILD/pair_transfer "$@" > /dev/null